@@ -12,6 +12,8 @@
  * @date       2022-16-09
  */
 
+#define _GNU_SOURCE     // cpu_set_t and sched_setaffinity()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -21,13 +23,62 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <linux/mempolicy.h>
 #include <stdbool.h>
 
 #define MAX_INPUT_CHARS 256
-#define MAX_INPUT_ARGS 20
+#define MAX_INPUT_ARGS 256
 #define MAX_PATH_LENGTH 2048
+#define MAX_SHELL_PATHS 50      // includes the NULL that ends the list
+
+char* shellPaths[MAX_SHELL_PATHS] = {0};
+
+/**
+ * @brief Set while a command substitution, $(...), is capturing
+ *       output. Text colors and list decorations are left out of
+ *       captured output so it can be split into plain arguments.
+ */
+bool isCapturingOutput = false;
+
+/**
+ * @brief The exit status of the last command that finished: 0 for
+ *       success. Built-ins return 1 when they fail, and external 
+ *       commands give their exit code, or 128 plus the signal that
+ *       killed them.
+ */
+int lastCommandStatus = 0;
 
-char* shellPaths[50] = {0};
+/**
+ * @brief Where warnings and errors go while output is captured, if 
+ *       they are captured too. A wash server sends them to its client
+ *       as error output. When NULL they are printed to stderr.
+ */
+FILE* capturedErrors = NULL;
+
+/**
+ * @brief The client connection whose command is running when wash is
+ *       in server mode (wash --serve), otherwise NULL. External 
+ *       commands are started in the background for this connection
+ *       instead of being waited on.
+ */
+struct ServerConnection* serverConnection = NULL;
 
 /**
  * @brief Shell color codes for output text color.
@@ -72,9 +123,69 @@ typedef enum Command {
     SETPATH = 4,
     GETPATH = 5,
     LS = 6,
-    HELP = 7
+    HELP = 7,
+    AFFINITY = 8,
+    NUMA = 9,
+    ZYGOTE = 10,
+    MEMO = 11,
+    TIMEOUT = 12,
+    LIMIT = 13
 } Command;
 
+/**
+ * @brief How external commands are placed on CPUs or NUMA nodes.
+ *       Set with the 'affinity' and 'numa' wash commands.
+ */
+typedef enum PlacementMode {
+    PLACEMENT_OFF = 0,          // inherit wash's placement
+    PLACEMENT_FIXED = 1,        // 'affinity <cpus>'
+    PLACEMENT_INTERLEAVE = 2,   // 'numa interleave'
+    PLACEMENT_LOCAL = 3,        // 'numa local'
+    PLACEMENT_ROUND_ROBIN = 4   // 'affinity rr' or 'numa rr'
+} PlacementMode;
+
+/**
+ * @brief The session's launch placement. Round-robin counters
+ *       advance each time an external command is started.
+ */
+typedef struct LaunchPlacement {
+    PlacementMode cpuMode;
+    cpu_set_t cpuSet;           // used by PLACEMENT_FIXED
+    size_t nextCpu;
+    PlacementMode numaMode;
+    size_t nextNode;
+} LaunchPlacement;
+
+LaunchPlacement launchPlacement = {0};
+
+/**
+ * @brief Resource limits for external commands. The rlimits are the
+ *       session defaults set with the 'limit' wash command, and the
+ *       timeout is set for one command by 'timeout'. Zero means no
+ *       limit.
+ */
+typedef struct LaunchLimits {
+    rlim_t cpuSeconds;          // RLIMIT_CPU
+    rlim_t addressSpaceMB;      // RLIMIT_AS
+    rlim_t openFiles;           // RLIMIT_NOFILE
+    unsigned long timeoutMilliseconds;
+} LaunchLimits;
+
+LaunchLimits launchLimits = {0};
+
+/**
+ * @brief The placement resolved for one external command. It is 
+ *       filled in by the parent before forking and applied by the
+ *       child between fork and exec.
+ */
+typedef struct LaunchPolicy {
+    bool hasCpuSet;
+    cpu_set_t cpuSet;
+    int memoryPolicy;           // MPOL_DEFAULT leaves memory placement alone
+    unsigned long nodeMask;
+    LaunchLimits limits;        // the timeout is enforced by the parent
+} LaunchPolicy;
+
 /**
  * @brief Helper function to allocate a string to the heap.
  *          This is used by the setpath command so the 
@@ -89,6 +200,39 @@ char* AllocateHeapString(const char* string){
     strcpy(savedPath,string);
     return savedPath;
 }
+/**
+ * @brief Growable byte buffer. Collects the output captured by a
+ *       command substitution, $(...), and the expanded input line
+ *       the captured output is spliced into.
+ */
+typedef struct CaptureBuffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+} CaptureBuffer;
+
+/**
+ * @brief Appends bytes to the end of a CaptureBuffer, doubling its
+ *       capacity when it runs out of room. The data is always kept
+ *       '\0' terminated so it can be used as a string.
+ * 
+ * @param buffer - the buffer to append to.
+ * @param bytes - the bytes to append.
+ * @param count - number of bytes to append.
+ */
+void CaptureBufferAppend(CaptureBuffer* buffer, const char* bytes, size_t count) {
+    if (buffer->length + count + 1 > buffer->capacity) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity : 128;
+        while (buffer->length + count + 1 > capacity) {
+            capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, bytes, count);
+    buffer->length += count;
+    buffer->data[buffer->length] = '\0';
+}
 /**
  * @brief Frees the path strings allocated by AllocateHeapString.
  *        The shellPaths variable points to an array of strings
@@ -105,6 +249,48 @@ void FreeShellPathMemory(){
     }
 }
 
+#define HASH_SEED 14695981039346656037ULL
+
+/**
+ * @brief Hashes bytes with 64-bit FNV-1a. Pass HASH_SEED to start a
+ *       new hash, or a previous result to continue one.
+ * 
+ * @param data - the bytes to hash.
+ * @param size - number of bytes.
+ * @param hash - HASH_SEED or the hash so far.
+ * @return uint64_t - the updated hash.
+ */
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+/**
+ * @brief Writes all of the given bytes to a file descriptor, 
+ *       retrying after partial writes and interrupts.
+ * 
+ * @param fd - the file descriptor to write to.
+ * @param data - the bytes to write.
+ * @param size - number of bytes to write.
+ * @return true/false - were all bytes written?
+ */
+bool WriteAll(int fd, const void* data, size_t size) {
+    const char* bytes = data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
 /**
  * @brief Sets the color and font style of command line output  
  *       printed after this function call. the BOLD_TEXT style
@@ -114,6 +300,9 @@ void FreeShellPathMemory(){
  * @param style - the font style of the command line text
  */
 void SetTextColorAndStyle(const Color color, const Style style) {
+    if (isCapturingOutput)
+        return;
+
     char colorCode[3];
     char styleCode[3];
     sprintf(colorCode, "%d", color);
@@ -160,10 +349,41 @@ int GetInputCommandCode(char command[]) {
     else if ( strcmp(command, "help") == 0 ) {
         return HELP;
     }
+    else if ( strcmp(command, "affinity") == 0 ) {
+        return AFFINITY;
+    }
+    else if ( strcmp(command, "numa") == 0 ) {
+        return NUMA;
+    }
+    else if ( strcmp(command, "zygote") == 0 ) {
+        return ZYGOTE;
+    }
+    else if ( strcmp(command, "memo") == 0 ) {
+        return MEMO;
+    }
+    else if ( strcmp(command, "timeout") == 0 ) {
+        return TIMEOUT;
+    }
+    else if ( strcmp(command, "limit") == 0 ) {
+        return LIMIT;
+    }
     else {
         return UNKNOWN;
     }
 }
+/**
+ * @brief Returns where warnings and errors are printed. While a 
+ *       built-in's output is captured by $(...) they go to stderr,
+ *       so they show up on the console instead of in the captured
+ *       output.
+ * 
+ * @return FILE* - stdout, or stderr or capturedErrors while capturing.
+ */
+FILE* GetMessageStream() {
+    if (!isCapturingOutput)
+        return stdout;
+    return capturedErrors != NULL ? capturedErrors : stderr;
+}
 /**
  * @brief Simple helper function that prints an additional arguments 
  *       warning for the given command.
@@ -172,8 +392,8 @@ int GetInputCommandCode(char command[]) {
  */
 void PrintExtraArgsWarning(char* command) {
     SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
-    printf("'%s' does not accept any arguments. The ", command);
-    printf("additional arguments were ignored. ¯\\_(`-`)_/¯ \n\n");
+    fprintf(GetMessageStream(), "'%s' does not accept any arguments. The ", command);
+    fprintf(GetMessageStream(), "additional arguments were ignored. ¯\\_(`-`)_/¯ \n\n");
 }
 /**
  * @brief Simple helper function that prints a formatted error message.
@@ -182,7 +402,7 @@ void PrintExtraArgsWarning(char* command) {
  */
 void PrintError(char* errorMsg){
     SetTextColorAndStyle(RED_COLOR, REGULAR_FONT);
-    printf("(╯°`o°)╯ ┻━┻: %s\n\n", errorMsg);
+    fprintf(GetMessageStream(), "(╯°`o°)╯ ┻━┻: %s\n\n", errorMsg);
 }
 /**
  * @brief The function corresponding to the 'pwd' wash command.
@@ -191,8 +411,9 @@ void PrintError(char* errorMsg){
  *       warn the user of argument usage on this function.
  * 
  * @param argCount - numer of arguments given for this command.
+ * @return int - always 0.
  */
-void CommandPwd(size_t argCount) {
+int CommandPwd(size_t argCount) {
     if (argCount > 0)
         PrintExtraArgsWarning("pwd");
 
@@ -200,6 +421,7 @@ void CommandPwd(size_t argCount) {
     char cwd[512];
     getcwd(cwd, 512);
     printf("%s\n\n", cwd);
+    return 0;
 }
 /**
  * @brief The function corresponding to the 'cd' wash command.
@@ -210,8 +432,9 @@ void CommandPwd(size_t argCount) {
  * 
  * @param args - the array of arguments given for this command.
  * @param argCount - numer of arguments given for this command.
+ * @return int - 0 on success, 1 on failure.
  */
-void CommandCd(char** args, size_t argCount) {
+int CommandCd(char** args, size_t argCount) {
     int isSuccess = 0;
     // if no args, set cwd to HOME
     if (argCount == 0){
@@ -222,8 +445,8 @@ void CommandCd(char** args, size_t argCount) {
     else {
         if (argCount > 1) {
             SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
-            printf("'cd' does not accept more than one argument. The ");
-            printf("additional arguments were ignored. ¯\\_(`-`)_/¯ \n");
+            fprintf(GetMessageStream(), "'cd' does not accept more than one argument. The ");
+            fprintf(GetMessageStream(), "additional arguments were ignored. ¯\\_(`-`)_/¯ \n");
         }
         
         isSuccess = chdir(args[0]);
@@ -233,7 +456,9 @@ void CommandCd(char** args, size_t argCount) {
     if (isSuccess == -1) {
         SetTextColorAndStyle(RED_COLOR, REGULAR_FONT);
         PrintError(strerror( errno ));
+        return 1;
     }
+    return 0;
 }
 /**
  * @brief The function corresponding to the 'setpath' wash command.
@@ -247,15 +472,24 @@ void CommandCd(char** args, size_t argCount) {
  * 
  * @param args - the array of arguments given for this command.
  * @param argCount - numer of arguments given for this command.
+ * @return int - 0 on success, 1 on failure.
  */
-void CommandSetPath(char** args, size_t argCount) {
+int CommandSetPath(char** args, size_t argCount) {
 
     // error if no arguments
     if (argCount == 0) {
         PrintError("'setpath' must include at least one path argument.");
-        return;
+        return 1;
     }
     
+    // globs can expand to more paths than fit
+    if (argCount > MAX_SHELL_PATHS - 1) {
+        SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+        fprintf(GetMessageStream(), "'setpath' keeps at most %d paths. ", MAX_SHELL_PATHS - 1);
+        fprintf(GetMessageStream(), "The additional paths were ignored. ¯\\_(`-`)_/¯ \n\n");
+        argCount = MAX_SHELL_PATHS - 1;
+    }
+
     // save each argument in the heap
     FreeShellPathMemory();
     size_t i = 0;
@@ -265,6 +499,7 @@ void CommandSetPath(char** args, size_t argCount) {
 
     // set stop symbol for ShellPaths array
     shellPaths[i] = '\0';
+    return 0;
 }
 /**
  * @brief The function corresponding to the 'getpath' wash command.
@@ -272,8 +507,9 @@ void CommandSetPath(char** args, size_t argCount) {
  *       No arguments are needed for this command.
  * 
  * @param argCount - numer of arguments given for this command.
+ * @return int - always 0.
  */
-void CommandGetPath(size_t argCount) {
+int CommandGetPath(size_t argCount) {
     if (argCount > 0)
         PrintExtraArgsWarning("getpath");
 
@@ -281,6 +517,11 @@ void CommandGetPath(size_t argCount) {
     size_t i = 0;
     char* current;
     while ( (current = shellPaths[i]) != NULL ) {
+        if (isCapturingOutput) {
+            printf("%s\n", current);
+            i += 1;
+            continue;
+        }
         SetTextColorAndStyle(BLACK_COLOR, BOLD_FONT);
         printf(" > ");
         SetTextColorAndStyle(BLUE_COLOR, REGULAR_FONT);
@@ -288,77 +529,568 @@ void CommandGetPath(size_t argCount) {
         i += 1;
     }
     printf("\n");
+    return 0;
+}
+/**
+ * @brief Listing options for the 'ls' wash command.
+ */
+typedef enum LsSortKey {
+    SORT_BY_NAME = 0,
+    SORT_BY_SIZE = 1,   // -S, largest first
+    SORT_BY_TIME = 2    // -t, newest first
+} LsSortKey;
+
+/**
+ * @brief The entries of one listing, kept as a struct of arrays so 
+ *       sorting by one field only touches that field's array. Names
+ *       are packed one after another in a single buffer.
+ */
+typedef struct LsEntries {
+    size_t count;
+    size_t capacity;
+    CaptureBuffer names;
+    size_t* nameOffsets;
+    off_t* sizes;
+    struct timespec* modified;
+    mode_t* modes;
+    nlink_t* links;
+    uid_t* owners;
+    gid_t* groups;
+} LsEntries;
+
+/**
+ * @brief What the entry comparison needs to know, passed to qsort_r().
+ */
+typedef struct LsSortContext {
+    const LsEntries* entries;
+    LsSortKey key;
+    bool isReversed;
+} LsSortContext;
+
+#define PARALLEL_SORT_MINIMUM 16384
+#define MAX_SORT_THREADS 8
+
+/**
+ * @brief Adds an entry and its stats to a listing.
+ * 
+ * @param entries - the listing.
+ * @param name - the name to print for the entry.
+ * @param entryStat - the entry's stats.
+ */
+void LsEntriesAdd(LsEntries* entries, const char* name, const struct stat* entryStat) {
+    if (entries->count == entries->capacity) {
+        size_t capacity = entries->capacity > 0 ? entries->capacity * 2 : 256;
+        entries->nameOffsets = realloc(entries->nameOffsets, capacity * sizeof(size_t));
+        entries->sizes = realloc(entries->sizes, capacity * sizeof(off_t));
+        entries->modified = realloc(entries->modified, capacity * sizeof(struct timespec));
+        entries->modes = realloc(entries->modes, capacity * sizeof(mode_t));
+        entries->links = realloc(entries->links, capacity * sizeof(nlink_t));
+        entries->owners = realloc(entries->owners, capacity * sizeof(uid_t));
+        entries->groups = realloc(entries->groups, capacity * sizeof(gid_t));
+        entries->capacity = capacity;
+    }
+    size_t i = entries->count;
+    entries->nameOffsets[i] = entries->names.length;
+    CaptureBufferAppend(&entries->names, name, strlen(name) + 1);
+    entries->sizes[i] = entryStat->st_size;
+    entries->modified[i] = entryStat->st_mtim;
+    entries->modes[i] = entryStat->st_mode;
+    entries->links[i] = entryStat->st_nlink;
+    entries->owners[i] = entryStat->st_uid;
+    entries->groups[i] = entryStat->st_gid;
+    entries->count += 1;
+}
+/**
+ * @brief Frees the memory of a listing.
+ * 
+ * @param entries - the listing.
+ */
+void LsEntriesFree(LsEntries* entries) {
+    free(entries->names.data);
+    free(entries->nameOffsets);
+    free(entries->sizes);
+    free(entries->modified);
+    free(entries->modes);
+    free(entries->links);
+    free(entries->owners);
+    free(entries->groups);
+}
+/**
+ * @brief qsort_r() comparison for two entry indexes. Ties on size or
+ *       time are broken by name.
+ * 
+ * @param a - pointer to the first index.
+ * @param b - pointer to the second index.
+ * @param context - the LsSortContext.
+ * @return int - less than, equal to or greater than zero.
+ */
+int CompareLsEntries(const void* a, const void* b, void* context) {
+    const LsSortContext* sort = context;
+    const LsEntries* entries = sort->entries;
+    uint32_t first = *(const uint32_t*)a;
+    uint32_t second = *(const uint32_t*)b;
+    int result = 0;
+
+    if (sort->key == SORT_BY_SIZE && entries->sizes[first] != entries->sizes[second]) {
+        result = entries->sizes[first] > entries->sizes[second] ? -1 : 1;
+    }
+    else if (sort->key == SORT_BY_TIME) {
+        const struct timespec* firstTime = &entries->modified[first];
+        const struct timespec* secondTime = &entries->modified[second];
+        if (firstTime->tv_sec != secondTime->tv_sec)
+            result = firstTime->tv_sec > secondTime->tv_sec ? -1 : 1;
+        else if (firstTime->tv_nsec != secondTime->tv_nsec)
+            result = firstTime->tv_nsec > secondTime->tv_nsec ? -1 : 1;
+    }
+    if (result == 0) {
+        result = strcmp(entries->names.data + entries->nameOffsets[first],
+                        entries->names.data + entries->nameOffsets[second]);
+    }
+    return sort->isReversed ? -result : result;
+}
+
+/**
+ * @brief One slice of the order array, sorted by its own thread.
+ */
+typedef struct LsSortSlice {
+    uint32_t* order;
+    size_t count;
+    LsSortContext* context;
+} LsSortSlice;
+
+/**
+ * @brief Thread function that sorts one slice.
+ * 
+ * @param argument - the LsSortSlice.
+ * @return void* - always NULL.
+ */
+void* SortLsSlice(void* argument) {
+    LsSortSlice* slice = argument;
+    qsort_r(slice->order, slice->count, sizeof(uint32_t), CompareLsEntries, slice->context);
+    return NULL;
+}
+/**
+ * @brief Sorts the entry indexes in order. Large listings are split 
+ *       into slices that are sorted on separate threads and then 
+ *       merged together in pairs.
+ * 
+ * @param order - the entry indexes to sort.
+ * @param count - number of indexes.
+ * @param context - how to compare entries.
+ */
+void SortLsEntries(uint32_t* order, size_t count, LsSortContext* context) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threadCount = processors > MAX_SORT_THREADS ? MAX_SORT_THREADS : (processors > 0 ? processors : 1);
+    if (count < PARALLEL_SORT_MINIMUM || threadCount < 2) {
+        qsort_r(order, count, sizeof(uint32_t), CompareLsEntries, context);
+        return;
+    }
+
+    // sort each slice on its own thread; a slice that can't get a
+    // thread is sorted here instead
+    pthread_t threads[MAX_SORT_THREADS];
+    bool isStarted[MAX_SORT_THREADS] = {0};
+    LsSortSlice slices[MAX_SORT_THREADS];
+    size_t sliceSize = (count + threadCount - 1) / threadCount;
+    for (size_t i = 0; i < threadCount; i++) {
+        size_t start = i * sliceSize < count ? i * sliceSize : count;
+        size_t end = start + sliceSize < count ? start + sliceSize : count;
+        slices[i] = (LsSortSlice){ order + start, end - start, context };
+        isStarted[i] = pthread_create(&threads[i], NULL, SortLsSlice, &slices[i]) == 0;
+        if (!isStarted[i])
+            SortLsSlice(&slices[i]);
+    }
+    for (size_t i = 0; i < threadCount; i++) {
+        if (isStarted[i])
+            pthread_join(threads[i], NULL);
+    }
+
+    // merge neighbouring sorted runs until one run is left
+    uint32_t* source = order;
+    uint32_t* merged = malloc(count * sizeof(uint32_t));
+    for (size_t runSize = sliceSize; runSize < count; runSize *= 2) {
+        for (size_t start = 0; start < count; start += 2 * runSize) {
+            size_t middle = start + runSize < count ? start + runSize : count;
+            size_t end = start + 2 * runSize < count ? start + 2 * runSize : count;
+            size_t left = start;
+            size_t right = middle;
+            size_t out = start;
+            while (left < middle && right < end) {
+                if (CompareLsEntries(&source[right], &source[left], context) < 0)
+                    merged[out++] = source[right++];
+                else
+                    merged[out++] = source[left++];
+            }
+            while (left < middle)
+                merged[out++] = source[left++];
+            while (right < end)
+                merged[out++] = source[right++];
+        }
+        uint32_t* swap = source;
+        source = merged;
+        merged = swap;
+    }
+    if (source != order)
+        memcpy(order, source, count * sizeof(uint32_t));
+    free(source == order ? merged : source);
+}
+
+/**
+ * @brief A user or group id and its name, remembered between listings.
+ */
+typedef struct NameCacheEntry {
+    unsigned int id;
+    char name[33];
+} NameCacheEntry;
+
+/**
+ * @brief Remembered user and group names. Large listings usually have
+ *       only a few owners, so each id is looked up through NSS once.
+ */
+typedef struct NameCache {
+    NameCacheEntry* entries;
+    size_t count;
+    size_t capacity;
+} NameCache;
+
+NameCache userNames = {0};
+NameCache groupNames = {0};
+
+/**
+ * @brief Looks up the name of a user or group id, using the cache when
+ *       the id was seen before. Ids without a name print as numbers.
+ * 
+ * @param cache - userNames or groupNames.
+ * @param id - the uid or gid.
+ * @param isGroup - look up a group instead of a user?
+ * @return const char* - the name. Valid until the cache grows.
+ */
+const char* LookupIdName(NameCache* cache, unsigned int id, bool isGroup) {
+    for (size_t i = 0; i < cache->count; i++) {
+        if (cache->entries[i].id == id)
+            return cache->entries[i].name;
+    }
+
+    if (cache->count == cache->capacity) {
+        cache->capacity = cache->capacity > 0 ? cache->capacity * 2 : 16;
+        cache->entries = realloc(cache->entries, cache->capacity * sizeof(NameCacheEntry));
+    }
+    NameCacheEntry* entry = &cache->entries[cache->count];
+    cache->count += 1;
+    entry->id = id;
+
+    const char* name = NULL;
+    if (isGroup) {
+        struct group* groupEntry = getgrgid(id);
+        name = groupEntry ? groupEntry->gr_name : NULL;
+    }
+    else {
+        struct passwd* userEntry = getpwuid(id);
+        name = userEntry ? userEntry->pw_name : NULL;
+    }
+    if (name != NULL)
+        snprintf(entry->name, sizeof(entry->name), "%s", name);
+    else
+        snprintf(entry->name, sizeof(entry->name), "%u", id);
+    return entry->name;
+}
+/**
+ * @brief Sets the text color for an entry name: folders are blue,
+ *       executables are green and other files are light blue.
+ * 
+ * @param mode - the entry's st_mode.
+ */
+void SetEntryColor(mode_t mode) {
+    /* With the stat structre, we can check if it is a directory 
+    * using the S_ISDIR command. We can also check if the entry is
+    * executable by looking at the executable flag on the stat's 
+    * .st_mode property. The flag is viewed using the provided 
+    * bit mask S_IXUSR.
+    */
+    if ( S_ISDIR(mode) ) {              // is folder
+        SetTextColorAndStyle(BLUE_COLOR, REGULAR_FONT);
+    }
+    else if ( mode & S_IXUSR ) {        // check for executable flag
+        SetTextColorAndStyle(GREEN_COLOR, REGULAR_FONT);
+    }
+    else {                              // is file
+        SetTextColorAndStyle(BLUE_COLOR, BOLD_FONT);
+    }
+}
+/**
+ * @brief Prints a listing in long format: permissions, links, owner,
+ *       group, size, modification time and name. Symbolic links show
+ *       their own stats and where they point, like ls does, and are
+ *       colored like what they point to.
+ * 
+ * @param entries - the listing.
+ * @param order - the entry indexes in print order.
+ * @param directory - the directory the names are in, or NULL when 
+ *                    they are paths.
+ */
+void PrintLsLong(const LsEntries* entries, const uint32_t* order, const char* directory) {
+    // size the columns to their widest value
+    int linksWidth = 1, ownerWidth = 1, groupWidth = 1, sizeWidth = 1;
+    for (size_t i = 0; i < entries->count; i++) {
+        char number[32];
+        int width = snprintf(number, sizeof(number), "%lu", (unsigned long)entries->links[i]);
+        linksWidth = width > linksWidth ? width : linksWidth;
+        width = snprintf(number, sizeof(number), "%lld", (long long)entries->sizes[i]);
+        sizeWidth = width > sizeWidth ? width : sizeWidth;
+        width = strlen(LookupIdName(&userNames, entries->owners[i], false));
+        ownerWidth = width > ownerWidth ? width : ownerWidth;
+        width = strlen(LookupIdName(&groupNames, entries->groups[i], true));
+        groupWidth = width > groupWidth ? width : groupWidth;
+    }
+
+    time_t now = time(NULL);
+    for (size_t n = 0; n < entries->count; n++) {
+        uint32_t i = order[n];
+        mode_t mode = entries->modes[i];
+        char permissions[11] = "----------";
+        permissions[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' :
+                         S_ISBLK(mode) ? 'b' : S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's' : '-';
+        const char* flags = "rwxrwxrwx";
+        for (int bit = 0; bit < 9; bit++) {
+            if (mode & (0400 >> bit))
+                permissions[bit + 1] = flags[bit];
+        }
+
+        // like ls, show the year instead of the time for old or future files
+        char modified[32];
+        struct tm local;
+        localtime_r(&entries->modified[i].tv_sec, &local);
+        bool isRecent = entries->modified[i].tv_sec > now - 182 * 24 * 60 * 60 &&
+                        entries->modified[i].tv_sec <= now + 60 * 60;
+        strftime(modified, sizeof(modified), isRecent ? "%b %e %H:%M" : "%b %e  %Y", &local);
+
+        if (!isCapturingOutput) {
+            SetTextColorAndStyle(BLACK_COLOR, BOLD_FONT);
+            printf(" > ");
+            SetTextColorAndStyle(LIGHT_GRAY, REGULAR_FONT);
+        }
+        printf("%s %*lu %-*s %-*s %*lld %s ", permissions, linksWidth, (unsigned long)entries->links[i],
+               ownerWidth, LookupIdName(&userNames, entries->owners[i], false),
+               groupWidth, LookupIdName(&groupNames, entries->groups[i], true),
+               sizeWidth, (long long)entries->sizes[i], modified);
+
+        const char* name = entries->names.data + entries->nameOffsets[i];
+        if (!S_ISLNK(mode)) {
+            SetEntryColor(mode);
+            printf("%s\n", name);
+            continue;
+        }
+
+        char path[MAX_PATH_LENGTH];
+        char target[MAX_PATH_LENGTH];
+        struct stat targetStat;
+        snprintf(path, sizeof(path), "%s%s%s", directory ? directory : "", directory ? "/" : "", name);
+        ssize_t targetLength = readlink(path, target, sizeof(target) - 1);
+        target[targetLength > 0 ? targetLength : 0] = '\0';
+        SetEntryColor(stat(path, &targetStat) == 0 ? targetStat.st_mode : mode);
+        printf("%s -> %s\n", name, target);
+    }
+}
+/**
+ * @brief Prints a listing in columns that fill the terminal, going
+ *       down each column first, like ls does.
+ * 
+ * @param entries - the listing.
+ * @param order - the entry indexes in print order.
+ */
+void PrintLsColumns(const LsEntries* entries, const uint32_t* order) {
+    struct winsize window;
+    size_t terminalWidth = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > 0)
+        terminalWidth = window.ws_col;
+
+    size_t count = entries->count;
+    size_t* lengths = malloc(count * sizeof(size_t));
+    for (size_t n = 0; n < count; n++) {
+        lengths[n] = strlen(entries->names.data + entries->nameOffsets[order[n]]);
+    }
+
+    // use the most columns that fit; each column is as wide as its
+    // longest name plus two spaces, and the line starts with a space
+    size_t maxColumns = terminalWidth / 3 > 0 ? terminalWidth / 3 : 1;
+    size_t* widths = malloc(maxColumns * sizeof(size_t));
+    size_t columns = maxColumns < count ? maxColumns : count;
+    size_t rows = 1;
+    for (; columns > 1; columns--) {
+        rows = (count + columns - 1) / columns;
+        columns = (count + rows - 1) / rows;    // drop empty columns
+        size_t lineWidth = 1;
+        memset(widths, 0, columns * sizeof(size_t));
+        for (size_t n = 0; n < count && lineWidth <= terminalWidth; n++) {
+            size_t column = n / rows;
+            if (lengths[n] + 2 > widths[column]) {
+                lineWidth += lengths[n] + 2 - widths[column];
+                widths[column] = lengths[n] + 2;
+            }
+        }
+        if (lineWidth <= terminalWidth)
+            break;
+    }
+    if (columns <= 1) {
+        columns = 1;
+        rows = count;
+        widths[0] = 0;
+    }
+
+    for (size_t row = 0; row < rows; row++) {
+        printf(" ");
+        for (size_t column = 0; column < columns; column++) {
+            size_t n = column * rows + row;
+            if (n >= count)
+                break;
+            uint32_t i = order[n];
+            SetEntryColor(entries->modes[i]);
+            bool isLastInRow = column + 1 == columns || n + rows >= count;
+            printf("%-*s", isLastInRow ? 0 : (int)widths[column],
+                   entries->names.data + entries->nameOffsets[i]);
+        }
+        printf("\n");
+    }
+    free(lengths);
+    free(widths);
 }
 /**
  * @brief The function corresponding to the 'ls' wash command.
  *       This function prints out each directory entry in the 
- *       current working directory. The printed entries are 
- *       color coded by viewing their entry stats using the
- *       dirent.h and sys/stat.h libraries. This function
- *       does not accept any arguments. *       
+ *       current working directory, or in the given directory. The
+ *       printed entries are color coded by viewing their entry 
+ *       stats using the dirent.h and sys/stat.h libraries.
  * 
+ *       Entries are sorted by name, or with -S by size and -t by
+ *       modification time; -r reverses the order. -l prints the 
+ *       long format. On a terminal, names are printed in columns
+ *       unless -1 is given. Arguments that aren't a single folder
+ *       are listed as entries themselves, so 'ls -l *.log' works.
+ * 
+ * @param args - the array of arguments given for this command.
  * @param argCount - numer of arguments given for this command.
+ * @return int - 0 on success, 1 on failure.
  */
-void CommandLs(size_t argCount) {
-    if (argCount > 0)
-        PrintExtraArgsWarning("ls");
+int CommandLs(char** args, size_t argCount) {
+    bool isLong = false;
+    bool isOnePerLine = isCapturingOutput || !isatty(STDOUT_FILENO);
+    LsSortContext sort = { NULL, SORT_BY_NAME, false };
+    char** operands = calloc(argCount + 1, sizeof(char*));
+    size_t operandCount = 0;
 
-    DIR *dir;
-    struct dirent *entry;
-    char cwd[MAX_PATH_LENGTH];
-    char* result = getcwd(cwd, MAX_PATH_LENGTH);
+    for (size_t i = 0; i < argCount; i++) {
+        if (args[i][0] != '-' || args[i][1] == '\0') {
+            operands[operandCount++] = args[i];
+            continue;
+        }
+        for (const char* flag = args[i] + 1; *flag != '\0'; flag++) {
+            if (*flag == 'l')
+                isLong = true;
+            else if (*flag == 'S')
+                sort.key = SORT_BY_SIZE;
+            else if (*flag == 't')
+                sort.key = SORT_BY_TIME;
+            else if (*flag == 'r')
+                sort.isReversed = true;
+            else if (*flag == '1')
+                isOnePerLine = true;
+            else {
+                SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+                fprintf(GetMessageStream(), "'ls' does not know the option '-%c'. It was ignored. "
+                        "¯\\_(`-`)_/¯ \n", *flag);
+            }
+        }
+    }
 
-    // print out each entry that is not a ".." or "."
-    size_t count = 0; // see if there is anything here
+    LsEntries entries = {0};
+    struct stat entryStat;
+    const char* directory = NULL;   // set when listing a folder's contents
+    int status = 0;
+    if (operandCount == 0 || (operandCount == 1 && stat(operands[0], &entryStat) == 0 && 
+                              S_ISDIR(entryStat.st_mode))) {
+        /* opens the directory and returns a DIR */
+        directory = operandCount == 0 ? "." : operands[0];
+        DIR* dir = opendir(directory);
+        if (dir == NULL) {
+            PrintError(strerror( errno ));
+            free(operands);
+            return 1;
+        }
 
-    /* opens the current working directory and returns a DIR */
-    dir = opendir(cwd);
-    while ((entry = readdir(dir)) != NULL) {
-        /* readdir is passed a directory opened by opendir and returns
-         * a dirent (directory entry) structure. the dirent has a d_name
-         * property that can be used to print the name of this entry.
-        */
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            /* readdir is passed a directory opened by opendir and returns
+             * a dirent (directory entry) structure. the dirent has a d_name
+             * property that can be used to print the name of this entry.
+            */
 
-        // don't display the ".." and "." directory entries.
-        if ( strcmp(entry->d_name, "..") != 0 && strcmp(entry->d_name, ".") != 0){
-            SetTextColorAndStyle(BLACK_COLOR, BOLD_FONT);
-            printf(" > ");
+            // don't display the ".." and "." directory entries.
+            if (strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".") == 0)
+                continue;
 
-            count += 1;
-            //print out entry type using specific color
-            char entryPath[MAX_PATH_LENGTH] = {0};
-            strcpy(entryPath, cwd);
-            strcat(entryPath, "/");
-            strcat(entryPath, entry->d_name);
-
-            /* stat accepts both a path string to a directory entry and 
-            * a stat structure that will be assigned the stats of the 
-            * given entry. With the stat structre, we can check if it is
-            * a directory using the S_ISDIR command. We can also check if
-            * the entry is executable by looking at the executable flag on 
-            * the stat's .st_mode property. The flag is viewed using the 
-            * provided bit mask S_IXUSR.
+            /* fstatat is given the entry name relative to the open 
+            * directory and a stat structure that will be assigned the
+            * stats of the given entry. The long format shows a link's
+            * own stats, so it doesn't follow links.
             */
-            struct stat entryStat;
-            stat(entryPath, &entryStat);
-            if ( S_ISDIR(entryStat.st_mode) ) {        // is folder
-                SetTextColorAndStyle(BLUE_COLOR, REGULAR_FONT);
-            }
-            else if ( entryStat.st_mode & S_IXUSR ) {  // check for executable flag
-                SetTextColorAndStyle(GREEN_COLOR, REGULAR_FONT);
+            if (fstatat(dirfd(dir), entry->d_name, &entryStat, isLong ? AT_SYMLINK_NOFOLLOW : 0) == -1 &&
+                fstatat(dirfd(dir), entry->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) == -1) {
+                continue;
             }
-            else {                                     // is file
-                SetTextColorAndStyle(BLUE_COLOR, BOLD_FONT);
+            LsEntriesAdd(&entries, entry->d_name, &entryStat);
+        }
+        closedir(dir);
+    }
+    else {
+        for (size_t i = 0; i < operandCount; i++) {
+            int result = isLong ? lstat(operands[i], &entryStat) : stat(operands[i], &entryStat);
+            if (result == -1) {
+                SetTextColorAndStyle(RED_COLOR, REGULAR_FONT);
+                fprintf(GetMessageStream(), "(╯°`o°)╯ ┻━┻: %s: %s\n", operands[i], strerror( errno ));
+                status = 1;
+                continue;
             }
-            printf(" %s\n", entry->d_name);
+            LsEntriesAdd(&entries, operands[i], &entryStat);
         }
     }
-    if (count == 0) {
+    free(operands);
+
+    uint32_t* order = malloc((entries.count + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < entries.count; i++) {
+        order[i] = i;
+    }
+    sort.entries = &entries;
+    SortLsEntries(order, entries.count, &sort);
+
+    if (entries.count == 0 && status == 0 && !isCapturingOutput) {
         SetTextColorAndStyle(BLUE_COLOR, REGULAR_FONT);
         printf("nothing but a mouse here        ~~(__^·>\n");
     }
+    else if (isLong) {
+        PrintLsLong(&entries, order, directory);
+    }
+    else if (isCapturingOutput) {
+        // captured output is one plain name per line
+        for (size_t n = 0; n < entries.count; n++) {
+            printf("%s\n", entries.names.data + entries.nameOffsets[order[n]]);
+        }
+    }
+    else if (isOnePerLine) {
+        for (size_t n = 0; n < entries.count; n++) {
+            SetTextColorAndStyle(BLACK_COLOR, BOLD_FONT);
+            printf(" > ");
+            SetEntryColor(entries.modes[order[n]]);
+            printf(" %s\n", entries.names.data + entries.nameOffsets[order[n]]);
+        }
+    }
+    else {
+        PrintLsColumns(&entries, order);
+    }
     printf("\n");
-    closedir(dir);
+
+    free(order);
+    LsEntriesFree(&entries);
+    return status;
 }
 /**
  * @brief The function corresponding to the 'help' wash command.
@@ -368,8 +1100,9 @@ void CommandLs(size_t argCount) {
  *     
  * 
  * @param argCount - numer of arguments given for this command.
+ * @return int - always 0.
  */
-void CommandHelp(size_t argCount) {
+int CommandHelp(size_t argCount) {
     if (argCount > 0)
         PrintExtraArgsWarning("ls");
 
@@ -389,9 +1122,12 @@ void CommandHelp(size_t argCount) {
     printf("\n    - Exits the wash shell.\n");
 
     SetTextColorAndStyle(YELLOW_COLOR, BOLD_FONT);
-    printf("  ls");
+    printf("  ls [-lStr1] [dir|entries]");
     SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
-    printf("\n    - Prints the contents of the current directory.\n");
+    printf("\n    - Prints the contents of the current directory, or of the given\n"
+           "      directory. Other arguments are listed as entries.\n");
+    printf("    - Sorted by name, or -S by size and -t by time. -r reverses it.\n");
+    printf("    - -l prints the long format. -1 prints one name per line.\n");
 
     SetTextColorAndStyle(YELLOW_COLOR, BOLD_FONT);
     printf("  pwd");
@@ -416,6 +1152,47 @@ void CommandHelp(size_t argCount) {
     SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
     printf("\n    - Prints all the directories in the PATH variable set by 'setpath'.\n");
 
+    SetTextColorAndStyle(YELLOW_COLOR, BOLD_FONT);
+    printf("  affinity");
+    SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+    printf(" [cpus|rr|off] [command]\n    - Sets the CPUs external commands run on,");
+    printf(" like 0-7. 'rr' gives\n      each new command the next CPU.\n");
+    printf("    - optional command: only this command uses the setting.\n");
+
+    SetTextColorAndStyle(YELLOW_COLOR, BOLD_FONT);
+    printf("  numa");
+    SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+    printf(" [interleave|local|rr|off] [command]\n    - Sets the NUMA memory policy");
+    printf(" of external commands. 'rr'\n      binds each new command to the next node.\n");
+    printf("    - optional command: only this command uses the setting.\n");
+
+    SetTextColorAndStyle(YELLOW_COLOR, BOLD_FONT);
+    printf("  zygote");
+    SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+    printf(" [on [count]|off]\n    - Keeps count (default 2) pre-forked helpers");
+    printf(" waiting to run\n      external commands, so they start without a fork.\n");
+
+    SetTextColorAndStyle(YELLOW_COLOR, BOLD_FONT);
+    printf("  memo");
+    SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+    printf(" <command> [args]\n    - Runs an external command once and replays its");
+    printf(" cached output after that,\n      until the arguments, directory or argument");
+    printf(" files change.\n");
+    printf("    - 'memo --limit <MB>' sets the cache size, 'memo --clear' empties it.\n");
+
+    SetTextColorAndStyle(YELLOW_COLOR, BOLD_FONT);
+    printf("  timeout");
+    SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+    printf(" <secs> <command> [args]\n    - Runs a command and stops it with SIGTERM");
+    printf(" after secs seconds,\n      then SIGKILL two seconds later.\n");
+
+    SetTextColorAndStyle(YELLOW_COLOR, BOLD_FONT);
+    printf("  limit");
+    SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+    printf(" [cpu <secs>] [mem <MB>] [files <count>] | off\n");
+    printf("    - Limits the CPU time, address space and open files of external\n");
+    printf("      commands. A value of 'off' removes that limit.\n");
+
     SetTextColorAndStyle(YELLOW_COLOR, BOLD_FONT);
     printf("  help");
     SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
@@ -426,6 +1203,18 @@ void CommandHelp(size_t argCount) {
     printf("  Enter the name of the executable command along with any arguments.\n");
     printf("  All arguments should be delimited using a space. Example:\n");
     printf("    ʕ•ᴥ•ʔ  |> find my_file\n");
+    printf("\n");
+
+    printf("Glob Patterns:\n");
+    printf("  *, ?, [abc] and [a-z] match file names. ** matches any number of folders.\n");
+    printf("  A pattern that matches nothing is passed along unchanged. Example:\n");
+    printf("    ʕ•ᴥ•ʔ  |> new_head logs/**/*.log\n");
+    printf("\n");
+
+    printf("Command Substitution:\n");
+    printf("  $(cmd) is replaced by the output of cmd, split into arguments.\n");
+    printf("  Built-ins like pwd, getpath and ls run without a new process. Example:\n");
+    printf("    ʕ•ᴥ•ʔ  |> cd $(pwd)/my_folder\n");
 
     // printf("Redirection Operator:\n");
     // SetTextColorAndStyle(YELLOW_COLOR, BOLD_FONT);
@@ -433,128 +1222,3955 @@ void CommandHelp(size_t argCount) {
     // SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
     // printf("<filepath>  - Redirects output to the specified file.\n");
     printf("\n");
+    return 0;
 }
 /**
- * @brief Tries to execute the given command with it's arguments.
- *       
- *       Called by CommandHandler() when the command given doesn't
- *       mach one of the built-in commands. This function forks this
- *       process and then tries to execute the command name by looking 
- *       in each path set by the SetPath() function. The parent 
- *       process waits for the child to finish before returning to 
- *       the wash shell user prompt.
+ * @brief Replaces this process with the given command by looking
+ *       for the executable in each path set by 'setpath'. This
+ *       function only returns if the command could not be run.
  * 
  * @param args - array of strings. The command name followed by arguments.
- * @param argCount - numer of entries in the args array.
  */
-void CommandExternal(char** args, size_t argCount) {
-
-    int fork_id = fork();
+void ExecFromShellPaths(char** args) {
+    fflush(stdout); // exec throws away anything still buffered
+    char commandPath[MAX_PATH_LENGTH];
+    char* current;
+    size_t i = 0;
+    while ( (current = shellPaths[i]) != NULL ) {
+        i += 1;
+        strcpy(commandPath, current);
+        strcat(commandPath, "/");
+        strcat(commandPath, args[0]);
+        execvp(commandPath, args);  // only returns on failure
+    }
+}
+/**
+ * @brief Parses a list of CPU or node numbers, like "0-3,8,10-11",
+ *       into a cpu_set_t. This is the format used by the kernel in
+ *       /sys/devices/system and by the 'affinity' command.
+ * 
+ * @param text - the list to parse.
+ * @param set - receives the numbers in the list.
+ * @return true/false - was the list valid and not empty?
+ */
+bool ParseCpuList(const char* text, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* current = text;
+    while (*current != '\0' && *current != '\n') {
+        char* end;
+        long first = strtol(current, &end, 10);
+        long last = first;
+        if (end == current || first < 0)
+            return false;
+        if (*end == '-') {
+            current = end + 1;
+            last = strtol(current, &end, 10);
+            if (end == current || last < first)
+                return false;
+        }
+        if (last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
 
-    if (fork_id < 0) {
-        PrintError("Was not able to create a new process.");
-        return;
+        if (*end == ',')
+            end += 1;
+        else if (*end != '\0' && *end != '\n')
+            return false;
+        current = end;
     }
-    else if (fork_id == 0) { // I'm the child
-        // run the given program
-        SetTextColorAndStyle(BLUE_COLOR, BOLD_FONT);
-        printf("\nRUNNING  %s ", args[0]);
-        printf(".¸.·´¯·.¸¸·´¯`·.´¯`·.¸¸.·´¯`·.¸..><(((º>");
-        SetTextColorAndStyle(GREEN_COLOR, REGULAR_FONT);
-        printf("\n"); // required after for triggering color in child process
-
-        // check each PATH for the command given
-        char commandPath[MAX_PATH_LENGTH];
-        bool success = false;
-        char* current;
-        size_t i = 0;
-        while ( (current = shellPaths[i]) != NULL ) {
+    return CPU_COUNT(set) > 0;
+}
+/**
+ * @brief Reads a CPU or node list from a file in /sys.
+ * 
+ * @param path - the sysfs file to read.
+ * @param set - receives the numbers in the list.
+ * @return true/false - was the file read and parsed?
+ */
+bool ReadCpuListFile(const char* path, cpu_set_t* set) {
+    char text[1024] = {0};
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+    bool success = fgets(text, sizeof(text), file) != NULL && ParseCpuList(text, set);
+    fclose(file);
+    return success;
+}
+/**
+ * @brief Finds the n-th member of a cpu_set_t, wrapping around
+ *       when n is larger than the number of members.
+ * 
+ * @param set - the set to look in. Must not be empty.
+ * @param n - which member to find.
+ * @return int - the CPU or node number.
+ */
+int NthCpuInSet(const cpu_set_t* set, size_t n) {
+    n %= CPU_COUNT(set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set) && n-- == 0)
+            return cpu;
+    }
+    return 0;
+}
+/**
+ * @brief Prints a cpu_set_t in the compact "0-3,8" list format.
+ * 
+ * @param set - the set to print.
+ */
+void PrintCpuList(const cpu_set_t* set) {
+    bool first = true;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last += 1;
+        printf(first ? "%d" : ",%d", cpu);
+        if (last > cpu)
+            printf("-%d", last);
+        first = false;
+        cpu = last;
+    }
+}
+/**
+ * @brief Works out the CPUs and memory policy for the next external
+ *       command from the session placement set by 'affinity' and 
+ *       'numa'. Round-robin modes move on to the next CPU or node
+ *       each time this is called.
+ * 
+ * @param policy - receives the placement for the command.
+ */
+void ResolveLaunchPolicy(LaunchPolicy* policy) {
+    memset(policy, 0, sizeof(LaunchPolicy));
+    policy->memoryPolicy = MPOL_DEFAULT;
+    policy->limits = launchLimits;
+
+    if (launchPlacement.cpuMode == PLACEMENT_FIXED) {
+        policy->hasCpuSet = true;
+        policy->cpuSet = launchPlacement.cpuSet;
+    }
+    else if (launchPlacement.cpuMode == PLACEMENT_ROUND_ROBIN) {
+        // spread over the CPUs wash itself is allowed to use
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            int cpu = NthCpuInSet(&allowed, launchPlacement.nextCpu++);
+            policy->hasCpuSet = true;
+            CPU_ZERO(&policy->cpuSet);
+            CPU_SET(cpu, &policy->cpuSet);
+        }
+    }
+
+    if (launchPlacement.numaMode == PLACEMENT_OFF)
+        return;
+
+    cpu_set_t nodes;
+    if (!ReadCpuListFile("/sys/devices/system/node/online", &nodes))
+        CPU_ZERO(&nodes);
+
+    if (launchPlacement.numaMode == PLACEMENT_LOCAL) {
+        policy->memoryPolicy = MPOL_LOCAL;
+    }
+    else if (launchPlacement.numaMode == PLACEMENT_INTERLEAVE && CPU_COUNT(&nodes) > 0) {
+        policy->memoryPolicy = MPOL_INTERLEAVE;
+        for (int node = 0; node < (int)(sizeof(unsigned long) * 8); node++) {
+            if (CPU_ISSET(node, &nodes))
+                policy->nodeMask |= 1UL << node;
+        }
+    }
+    else if (launchPlacement.numaMode == PLACEMENT_ROUND_ROBIN && CPU_COUNT(&nodes) > 0) {
+        // bind memory to one node, and run on that node's CPUs unless
+        // 'affinity' already picked the CPUs
+        int node = NthCpuInSet(&nodes, launchPlacement.nextNode++);
+        if (node >= (int)(sizeof(unsigned long) * 8))
+            return;
+        policy->memoryPolicy = MPOL_BIND;
+        policy->nodeMask = 1UL << node;
+
+        char nodeCpusPath[MAX_PATH_LENGTH];
+        sprintf(nodeCpusPath, "/sys/devices/system/node/node%d/cpulist", node);
+        cpu_set_t nodeCpus;
+        if (!policy->hasCpuSet && ReadCpuListFile(nodeCpusPath, &nodeCpus)) {
+            policy->hasCpuSet = true;
+            policy->cpuSet = nodeCpus;
+        }
+    }
+}
+/**
+ * @brief Lowers one resource limit of this process. The hard limit is
+ *       lowered too, so the command can't raise it back. For CPU time
+ *       the hard limit is one second later: the command gets SIGXCPU
+ *       at the soft limit and SIGKILL if it keeps going.
+ * 
+ * @param resource - the RLIMIT_ constant.
+ * @param value - the new limit, or 0 to leave it alone.
+ * @param name - the limit's name for error messages.
+ */
+void ApplyResourceLimit(int resource, rlim_t value, const char* name) {
+    struct rlimit limit;
+    if (value == 0 || getrlimit(resource, &limit) == -1)
+        return;
+
+    rlim_t hardLimit = resource == RLIMIT_CPU ? value + 1 : value;
+    if (limit.rlim_max == RLIM_INFINITY || hardLimit < limit.rlim_max)
+        limit.rlim_max = hardLimit;
+    limit.rlim_cur = value < limit.rlim_max ? value : limit.rlim_max;
+    if (setrlimit(resource, &limit) == -1) {
+        fprintf(stderr, "(╯°`o°)╯ ┻━┻: %s limit not applied: %s\n", name, strerror( errno ));
+    }
+}
+/**
+ * @brief Applies a resolved placement to this process. Called by the
+ *       child between fork and exec so the command starts on the
+ *       chosen CPUs and nodes, with the session's resource limits.
+ *       Failures are reported but the command still runs.
+ * 
+ * @param policy - the placement to apply.
+ */
+void ApplyLaunchPolicy(const LaunchPolicy* policy) {
+    if (policy->hasCpuSet && sched_setaffinity(0, sizeof(cpu_set_t), &policy->cpuSet) == -1) {
+        fprintf(stderr, "(╯°`o°)╯ ┻━┻: affinity not applied: %s\n", strerror( errno ));
+    }
+
+    if (policy->memoryPolicy != MPOL_DEFAULT) {
+        unsigned long nodeMask = policy->nodeMask;
+        unsigned long maxNode = policy->nodeMask ? sizeof(nodeMask) * 8 + 1 : 0;
+        if (syscall(SYS_set_mempolicy, policy->memoryPolicy,
+                    policy->nodeMask ? &nodeMask : NULL, maxNode) == -1) {
+            fprintf(stderr, "(╯°`o°)╯ ┻━┻: numa policy not applied: %s\n", strerror( errno ));
+        }
+    }
+
+    ApplyResourceLimit(RLIMIT_CPU, policy->limits.cpuSeconds, "cpu time");
+    ApplyResourceLimit(RLIMIT_AS, policy->limits.addressSpaceMB * 1024 * 1024, "address space");
+    ApplyResourceLimit(RLIMIT_NOFILE, policy->limits.openFiles, "open files");
+}
+/**
+ * @brief Looks for an executable named commandName in each path of a
+ *       NULL terminated list, the same order ExecFromShellPaths() 
+ *       tries the paths set by 'setpath'.
+ * 
+ * @param paths - the directories to look in.
+ * @param commandName - the name of the command.
+ * @param commandPath - receives the full path of the executable.
+ * @return true/false - was an executable found?
+ */
+bool FindInPathList(char** paths, const char* commandName, char* commandPath) {
+    char* current;
+    size_t i = 0;
+    while ( (current = paths[i]) != NULL ) {
+        i += 1;
+        snprintf(commandPath, MAX_PATH_LENGTH, "%s/%s", current, commandName);
+        if (access(commandPath, X_OK) == 0)
+            return true;
+    }
+    return false;
+}
+
+#define MAX_ZYGOTES 8
+#define ZYGOTE_REQUEST_SIZE 65536
+
+/**
+ * @brief A pre-forked helper process that waits for a command to run.
+ *       The helper execs the command as soon as a request arrives on
+ *       its socket, so launching skips the fork.
+ */
+typedef struct Zygote {
+    pid_t pid;
+    int socket;     // wash's end of the helper's socketpair
+} Zygote;
+
+/**
+ * @brief The pool of waiting helpers, filled by the 'zygote' command.
+ *       Empty when zygote mode is off. The helpers are forked by a 
+ *       master process, so wash itself never forks to refill the 
+ *       pool; it asks the master for a replacement after each launch
+ *       and picks it up on a later one.
+ */
+typedef struct ZygotePool {
+    Zygote helpers[MAX_ZYGOTES];
+    size_t count;
+    size_t size;        // how many helpers the pool is kept filled to
+    size_t requested;   // asked of the master, not yet received
+    pid_t masterPid;    // the process that forks helpers, or 0
+    int masterSocket;   // wash's end of the master's socketpair
+} ZygotePool;
+
+ZygotePool zygotePool = {0};
+
+/**
+ * @brief The fixed part of a request sent to a helper. It is followed
+ *       by the executable path, the working directory, and argCount 
+ *       argument strings, each '\0' terminated. The command's stdin,
+ *       stdout and stderr are passed along with SCM_RIGHTS.
+ */
+typedef struct ZygoteRequest {
+    LaunchPolicy policy;
+    uint32_t argCount;
+} ZygoteRequest;
+
+/**
+ * @brief The main loop of a helper process. Waits for one request,
+ *       sets up the received file descriptors, directory and launch
+ *       placement, and execs the command. The helper exits if wash
+ *       closes its socket.
+ * 
+ * @param socket - the helper's end of the socketpair.
+ */
+void ZygoteMain(int socket) {
+    char* request = malloc(ZYGOTE_REQUEST_SIZE);
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec io = { .iov_base = request, .iov_len = ZYGOTE_REQUEST_SIZE };
+    struct msghdr message = {
+        .msg_iov = &io, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+
+    ssize_t size;
+    do {
+        size = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    } while (size < 0 && errno == EINTR);
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (size < (ssize_t)sizeof(ZygoteRequest) || header == NULL ||
+        header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        _exit(0);   // wash is gone, or the request is broken
+    }
+
+    int fds[3];
+    memcpy(fds, CMSG_DATA(header), sizeof(fds));
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+    }
+
+    // unpack the strings that follow the fixed part
+    ZygoteRequest fixed;
+    memcpy(&fixed, request, sizeof(fixed));
+    char* commandPath = request + sizeof(fixed);
+    char* cwd = commandPath + strlen(commandPath) + 1;
+    char** args = calloc(fixed.argCount + 1, sizeof(char*));
+    char* current = cwd + strlen(cwd) + 1;
+    for (uint32_t i = 0; i < fixed.argCount; i++) {
+        args[i] = current;
+        current += strlen(current) + 1;
+    }
+
+    if (chdir(cwd) == -1) {
+        fprintf(stderr, "(╯°`o°)╯ ┻━┻: %s\n", strerror( errno ));
+        _exit(1);
+    }
+    ApplyLaunchPolicy(&fixed.policy);
+    execvp(commandPath, args);
+
+    fprintf(stderr, "(╯°`o°)╯ ┻━┻: Was not able to run '%s'. ", args[0]);
+    fprintf(stderr, "%s\n", strerror( errno ));
+    _exit(127);
+}
+/**
+ * @brief Forks one helper for the master. The helper is created with
+ *       CLONE_PARENT, so it is a child of wash like a forked command
+ *       would be, and wash can wait for the command it becomes.
+ * 
+ * @param socket - the master's end of its socketpair with wash.
+ * @return pid_t - the helper, or -1. wash's end of the helper's 
+ *              socketpair is sent to wash with it.
+ */
+pid_t ZygoteMasterSpawn(int socket) {
+    int ends[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ends) == -1)
+        return -1;
+
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+    if (pid == 0) { // I'm the helper
+        // keep stdio and our own socket only
+        int helperSocket = dup2(ends[1], 3);
+        fcntl(helperSocket, F_SETFD, FD_CLOEXEC);
+        close_range(4, ~0U, 0);
+        ZygoteMain(helperSocket);
+    }
+    close(ends[1]);
+    if (pid < 0) {
+        close(ends[0]);
+        return -1;
+    }
+
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec io = { .iov_base = &pid, .iov_len = sizeof(pid) };
+    struct msghdr message = {
+        .msg_iov = &io, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &ends[0], sizeof(int));
+    sendmsg(socket, &message, MSG_NOSIGNAL);
+    close(ends[0]);
+    return pid;
+}
+/**
+ * @brief The main loop of the zygote master. Each byte wash sends is
+ *       a request for one more helper, and each helper is sent back
+ *       with its pid. A pid of -1 means no helper could be started.
+ *       The master exits once wash closes its socket.
+ * 
+ * @param socket - the master's end of its socketpair with wash.
+ */
+void ZygoteMasterMain(int socket) {
+    char request;
+    while (true) {
+        ssize_t size = recv(socket, &request, 1, 0);
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            _exit(0);
+
+        if (ZygoteMasterSpawn(socket) == -1) {
+            pid_t failed = -1;
+            send(socket, &failed, sizeof(failed), MSG_NOSIGNAL);
+        }
+    }
+}
+/**
+ * @brief Forks the zygote master. It is forked once, when zygote mode
+ *       is turned on, and every helper comes from it after that.
+ * 
+ * @return true/false - was the master started?
+ */
+bool ZygoteStartMaster() {
+    int ends[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ends) == -1)
+        return false;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) { // I'm the master
+        // keep stdio and our own socket only. Helpers' sockets and
+        // server connections must not be held open by the master
+        int masterSocket = dup2(ends[1], 3);
+        fcntl(masterSocket, F_SETFD, FD_CLOEXEC);
+        close_range(4, ~0U, 0);
+        signal(SIGPIPE, SIG_DFL);   // inherited by the helpers
+        ZygoteMasterMain(masterSocket);
+    }
+
+    close(ends[1]);
+    if (pid < 0) {
+        close(ends[0]);
+        return false;
+    }
+    zygotePool.masterPid = pid;
+    zygotePool.masterSocket = ends[0];
+    zygotePool.requested = 0;
+    return true;
+}
+/**
+ * @brief Adds the helpers the master has sent to the pool.
+ * 
+ * @param isWaiting - wait for every requested helper, instead of only
+ *                    taking the ones already sent.
+ */
+void ZygoteCollect(bool isWaiting) {
+    while (zygotePool.masterPid != 0 && zygotePool.requested > 0) {
+        pid_t pid = -1;
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec io = { .iov_base = &pid, .iov_len = sizeof(pid) };
+        struct msghdr message = {
+            .msg_iov = &io, .msg_iovlen = 1,
+            .msg_control = control, .msg_controllen = sizeof(control)
+        };
+        ssize_t size = recvmsg(zygotePool.masterSocket, &message, 
+                               MSG_CMSG_CLOEXEC | (isWaiting ? 0 : MSG_DONTWAIT));
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            return;
+
+        zygotePool.requested -= 1;
+        struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+        if (pid <= 0 || header == NULL || header->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int helperSocket;
+        memcpy(&helperSocket, CMSG_DATA(header), sizeof(int));
+        zygotePool.helpers[zygotePool.count].pid = pid;
+        zygotePool.helpers[zygotePool.count].socket = helperSocket;
+        zygotePool.count += 1;
+    }
+}
+/**
+ * @brief Asks the master for helpers until the pool plus the helpers
+ *       on their way make up its size. Only a byte per helper is 
+ *       sent; the master forks them while wash goes on.
+ */
+void ZygoteRefill() {
+    while (zygotePool.masterPid != 0 && zygotePool.count + zygotePool.requested < zygotePool.size) {
+        if (send(zygotePool.masterSocket, "+", 1, MSG_DONTWAIT | MSG_NOSIGNAL) != 1)
+            return;
+        zygotePool.requested += 1;
+    }
+}
+/**
+ * @brief Stops every helper in the pool and the master. Closing a 
+ *       helper's socket makes it exit. Helpers still on their way 
+ *       are received and stopped too, since they are children of 
+ *       wash that must be waited for.
+ */
+void ZygoteStopAll() {
+    if (zygotePool.masterPid != 0) {
+        // the master exits after it sees the end of its requests
+        shutdown(zygotePool.masterSocket, SHUT_WR);
+        ZygoteCollect(true);
+        close(zygotePool.masterSocket);
+        waitpid(zygotePool.masterPid, NULL, 0);
+        zygotePool.masterPid = 0;
+    }
+    for (size_t i = 0; i < zygotePool.count; i++) {
+        close(zygotePool.helpers[i].socket);
+        waitpid(zygotePool.helpers[i].pid, NULL, 0);
+    }
+    zygotePool.count = 0;
+    zygotePool.size = 0;
+    zygotePool.requested = 0;
+}
+/**
+ * @brief Drops the pool in a forked child of wash, without stopping 
+ *       anything. The helpers and the master belong to wash, and a
+ *       command started by a helper is a child of wash, not of this
+ *       process, so it couldn't be waited for here.
+ */
+void ZygoteForget() {
+    zygotePool.count = 0;
+    zygotePool.size = 0;
+    zygotePool.requested = 0;
+    zygotePool.masterPid = 0;
+}
+/**
+ * @brief Launches a command through a waiting helper. The executable
+ *       is found here, and the helper only has to exec it. Helpers
+ *       the master has sent since the last launch are taken into the
+ *       pool first, and a replacement for the one used is asked for
+ *       after, so the master forks it while the command runs.
+ * 
+ * @param args - array of strings. The command name followed by arguments.
+ * @param knownPath - the executable if it is already known, or NULL.
+ * @param policy - the launch placement for the command.
+ * @param fds - the command's stdin, stdout and stderr.
+ * @return pid_t - the pid of the command, or -1 if no helper could
+ *              take it. The caller then falls back to fork().
+ */
+pid_t ZygoteLaunch(char** args, const char* knownPath, const LaunchPolicy* policy, const int fds[3]) {
+    char commandPath[MAX_PATH_LENGTH];
+    char cwd[MAX_PATH_LENGTH];
+    ZygoteCollect(false);
+    if (zygotePool.count == 0 || getcwd(cwd, MAX_PATH_LENGTH) == NULL)
+        return -1;
+    if (knownPath != NULL && access(knownPath, X_OK) == 0)
+        strcpy(commandPath, knownPath);
+    else if (!FindInPathList(shellPaths, args[0], commandPath))
+        return -1;
+
+    // pack the request
+    char* request = malloc(ZYGOTE_REQUEST_SIZE);
+    ZygoteRequest fixed = { .policy = *policy, .argCount = 0 };
+    size_t size = sizeof(fixed);
+    const char* strings[2] = { commandPath, cwd };
+    for (size_t i = 0; ; i++) {
+        const char* string = i < 2 ? strings[i] : args[i - 2];
+        if (string == NULL)
+            break;
+        size_t length = strlen(string) + 1;
+        if (size + length > ZYGOTE_REQUEST_SIZE) {
+            free(request);
+            return -1;
+        }
+        memcpy(request + size, string, length);
+        size += length;
+        if (i >= 2)
+            fixed.argCount += 1;
+    }
+    memcpy(request, &fixed, sizeof(fixed));
+
+    char control[CMSG_SPACE(3 * sizeof(int))] = {0};
+    struct iovec io = { .iov_base = request, .iov_len = size };
+    struct msghdr message = {
+        .msg_iov = &io, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(header), fds, 3 * sizeof(int));
+
+    // take helpers from the end of the pool until one accepts
+    pid_t pid = -1;
+    while (pid == -1 && zygotePool.count > 0) {
+        Zygote helper = zygotePool.helpers[--zygotePool.count];
+        if (sendmsg(helper.socket, &message, MSG_NOSIGNAL) == (ssize_t)size) {
+            pid = helper.pid;
+        }
+        else {
+            waitpid(helper.pid, NULL, 0);   // helper died; reap it
+        }
+        close(helper.socket);
+    }
+    free(request);
+    ZygoteRefill();
+    return pid;
+}
+struct MemoRun;
+bool ServerStartExternal(struct ServerConnection* connection, char** args, 
+                         const char* knownPath, struct MemoRun* memo);
+
+/**
+ * @brief Prints the banner shown before an external command's output.
+ *       Captured output doesn't get one.
+ * 
+ * @param label - what is happening, like "RUNNING".
+ * @param commandName - the name of the command.
+ */
+void PrintCommandBanner(const char* label, const char* commandName) {
+    if (isCapturingOutput)
+        return;
+
+    SetTextColorAndStyle(BLUE_COLOR, BOLD_FONT);
+    printf("\n%-8s %s ", label, commandName);
+    printf(".¸.·´¯·.¸¸·´¯`·.´¯`·.¸¸.·´¯`·.¸..><(((º>");
+    SetTextColorAndStyle(GREEN_COLOR, REGULAR_FONT);
+    printf("\n");
+}
+#define TERMINATE_GRACE_MILLISECONDS 2000
+
+/**
+ * @brief Reads the monotonic clock, which doesn't jump when the 
+ *       system time is changed.
+ * 
+ * @return long long - the clock in milliseconds.
+ */
+long long GetMonotonicMilliseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+/**
+ * @brief Waits for an external command to finish. With a timeout, the
+ *       wait is a poll() on a pidfd for the child, with the deadline
+ *       as poll's timeout, so no SIGALRM handler is needed. A command
+ *       still running at the deadline is sent SIGTERM, and SIGKILL if
+ *       it is still running two seconds after that.
+ * 
+ * @param pid - the command's process.
+ * @param timeoutMilliseconds - how long the command may run, or 0.
+ * @param status - receives the status from wait4().
+ * @param usage - receives the command's resource usage from wait4().
+ * @return int - the signal wash stopped the command with, or 0.
+ */
+int WaitForCommand(pid_t pid, unsigned long timeoutMilliseconds, int* status, struct rusage* usage) {
+    int stopSignal = 0;
+    int pidfd = -1;
+    if (timeoutMilliseconds > 0) {
+        pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (pidfd == -1)
+            fprintf(stderr, "(╯°`o°)╯ ┻━┻: timeout not applied: %s\n", strerror( errno ));
+    }
+
+    long long deadline = GetMonotonicMilliseconds() + timeoutMilliseconds;
+    while (pidfd != -1) {
+        long long remaining = deadline - GetMonotonicMilliseconds();
+        if (remaining <= 0 && stopSignal != SIGKILL) {
+            stopSignal = stopSignal == 0 ? SIGTERM : SIGKILL;
+            syscall(SYS_pidfd_send_signal, pidfd, stopSignal, NULL, 0);
+            deadline = GetMonotonicMilliseconds() + TERMINATE_GRACE_MILLISECONDS;
+            continue;
+        }
+
+        // the pidfd becomes readable when the command exits. a long
+        // deadline is waited for an hour at a time
+        struct pollfd exited = { .fd = pidfd, .events = POLLIN };
+        int waitTime = stopSignal == SIGKILL ? -1 : remaining > 3600000 ? 3600000 : (int)remaining;
+        int ready = poll(&exited, 1, waitTime);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready != 0)
+            break;
+    }
+    if (pidfd != -1)
+        close(pidfd);
+
+    while (wait4(pid, status, 0, usage) == -1 && errno == EINTR) {
+        continue;
+    }
+    return stopSignal;
+}
+/**
+ * @brief Describes why an external command stopped, for the status 
+ *       output: its timeout, its CPU time limit, or a signal. Nothing
+ *       is written for a command that exited by itself, unless it 
+ *       failed while an address space or open files limit was set,
+ *       since running into those makes calls fail instead of sending
+ *       a signal. A SIGKILL is only blamed on the CPU time limit when
+ *       the command's CPU time reached it.
+ * 
+ * @param commandName - the name of the command.
+ * @param status - the status from wait4().
+ * @param usage - the command's resource usage from wait4().
+ * @param stopSignal - the signal wash stopped the command with, or 0.
+ * @param policy - the launch policy the command ran with.
+ * @param message - receives the description, or an empty string.
+ * @param size - size of the message buffer.
+ */
+void DescribeCommandStop(const char* commandName, int status, const struct rusage* usage, 
+                         int stopSignal, const LaunchPolicy* policy, char* message, size_t size) {
+    const LaunchLimits* limits = &policy->limits;
+    int signalNumber = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    const char* signalName = signalNumber ? sigabbrev_np(signalNumber) : NULL;
+    message[0] = '\0';
+
+    // the hard CPU limit kills with SIGKILL, but so can anyone else
+    unsigned long long cpuSeconds = usage->ru_utime.tv_sec + usage->ru_stime.tv_sec +
+                                    (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1000000;
+    bool isCpuKill = signalNumber == SIGKILL && limits->cpuSeconds > 0 && cpuSeconds >= limits->cpuSeconds;
+
+    if (stopSignal != 0) {
+        snprintf(message, size, "'%s' ran past its %.3g second timeout and was stopped with SIG%s.",
+                 commandName, limits->timeoutMilliseconds / 1000.0, sigabbrev_np(stopSignal));
+    }
+    else if (signalNumber == SIGXCPU || isCpuKill) {
+        snprintf(message, size, "'%s' used up its %llu seconds of CPU time and was killed with SIG%s.",
+                 commandName, (unsigned long long)limits->cpuSeconds, signalName ? signalName : "?");
+    }
+    else if (signalNumber != 0) {
+        snprintf(message, size, "'%s' was killed with SIG%s.", commandName, signalName ? signalName : "?");
+    }
+    else if (WEXITSTATUS(status) == 0) {
+        return;
+    }
+
+    // name the limits that could have made it fail
+    size_t length = strlen(message);
+    const char* separator = " It was limited to";
+    if (length == 0 && (limits->addressSpaceMB > 0 || limits->openFiles > 0)) {
+        length = snprintf(message, size, "'%s' exited with status %d.", commandName, WEXITSTATUS(status));
+    }
+    else if (length == 0 || stopSignal != 0 || signalNumber == SIGXCPU) {
+        return;
+    }
+    if (limits->addressSpaceMB > 0 && length < size) {
+        length += snprintf(message + length, size - length, "%s %llu MB of address space", 
+                           separator, (unsigned long long)limits->addressSpaceMB);
+        separator = " and";
+    }
+    if (limits->openFiles > 0 && length < size) {
+        length += snprintf(message + length, size - length, "%s %llu open files", 
+                           separator, (unsigned long long)limits->openFiles);
+    }
+    if (length < size && (limits->addressSpaceMB > 0 || limits->openFiles > 0))
+        snprintf(message + length, size - length, ".");
+}
+/**
+ * @brief Prints why an external command stopped, if there is anything
+ *       to say. See DescribeCommandStop(). While output is captured 
+ *       the message goes to the console instead.
+ * 
+ * @param commandName - the name of the command.
+ * @param status - the status from wait4().
+ * @param usage - the command's resource usage from wait4().
+ * @param stopSignal - the signal wash stopped the command with, or 0.
+ * @param policy - the launch policy the command ran with.
+ * @return true/false - was anything printed?
+ */
+bool ReportCommandStop(const char* commandName, int status, const struct rusage* usage, 
+                       int stopSignal, const LaunchPolicy* policy) {
+    char message[512];
+    DescribeCommandStop(commandName, status, usage, stopSignal, policy, message, sizeof(message));
+    if (message[0] == '\0')
+        return false;
+
+    if (isCapturingOutput) {
+        fprintf(stderr, "%s\n", message);
+        return true;
+    }
+    SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+    printf("%s\n", message);
+    return true;
+}
+/**
+ * @brief Tries to execute the given command with it's arguments.
+ *       
+ *       Called by CommandExternal() and by precompiled scripts. This 
+ *       function forks this process and then tries to execute the 
+ *       command name by looking in each path set by the SetPath()
+ *       function. If the executable is already known, it is tried
+ *       first. The parent process waits for the child to finish, or
+ *       stops it at its timeout, before returning to the wash shell
+ *       user prompt.
+ * 
+ * @param args - array of strings. The command name followed by arguments.
+ * @param knownPath - the command's executable if it was found earlier, or NULL.
+ * @return int - the command's exit status, or 0 when a server runs it.
+ */
+int LaunchExternal(char** args, const char* knownPath) {
+
+    // the server reads the command's output from its event loop
+    if (serverConnection != NULL) {
+        ServerStartExternal(serverConnection, args, knownPath, NULL);
+        return 0;
+    }
+
+    // pick CPUs and nodes here so round-robin state lives in the parent
+    LaunchPolicy policy;
+    ResolveLaunchPolicy(&policy);
+
+    PrintCommandBanner("RUNNING", args[0]);
+    fflush(stdout); // don't let the child inherit unprinted output
+
+    // a waiting zygote helper runs the command without a fork
+    int standardFds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int fork_id = ZygoteLaunch(args, knownPath, &policy, standardFds);
+    if (fork_id == -1)
+        fork_id = fork();
+
+    if (fork_id < 0) {
+        PrintError("Was not able to create a new process.");
+        return 1;
+    }
+    else if (fork_id == 0) { // I'm the child
+        // place the child before it becomes the command
+        ApplyLaunchPolicy(&policy);
+
+        // try the known executable, then check each PATH for the command given
+        if (knownPath != NULL)
+            execvp(knownPath, args);
+        ExecFromShellPaths(args);
+
+        // still here, so none of the paths worked. newline isn't needed
+        PrintError("Was not able to run the command. Does it exist?");
+        fflush(stdout); // make sure this prints before parent prints
+        exit(1);        // child is finished
+    }
+    else
+    {
+        /* WaitForCommand waits for this command to finish, or for
+        * its timeout. The zygote helpers are children of wash too,
+        * so it waits for this pid rather than using wait(NULL).
+        */
+        int status = 0;
+        struct rusage usage;
+        int stopSignal = WaitForCommand(fork_id, policy.limits.timeoutMilliseconds, &status, &usage);
+        ReportCommandStop(args[0], status, &usage, stopSignal, &policy);
+        SetTextColorAndStyle(BLUE_COLOR, BOLD_FONT);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+}
+
+/**
+ * @brief Tries to execute the given command with it's arguments.
+ *       
+ *       Called by CommandHandler() when the command given doesn't
+ *       mach one of the built-in commands. The executable is looked 
+ *       for in each path set by the SetPath() function.
+ * 
+ * @param args - array of strings. The command name followed by arguments.
+ * @param argCount - numer of entries in the args array.
+ * @return int - the command's exit status.
+ */
+int CommandExternal(char** args, size_t argCount) {
+    return LaunchExternal(args, NULL);
+}
+
+int CommandHandler(char** userInputTokens, size_t tokenCount);
+
+/**
+ * @brief Prints the session's launch placement, as set by the
+ *       'affinity' and 'numa' commands.
+ */
+void PrintLaunchPlacement() {
+    SetTextColorAndStyle(BLACK_COLOR, BOLD_FONT);
+    printf(" > ");
+    SetTextColorAndStyle(BLUE_COLOR, REGULAR_FONT);
+    printf("affinity: ");
+    if (launchPlacement.cpuMode == PLACEMENT_FIXED) {
+        printf("cpus ");
+        PrintCpuList(&launchPlacement.cpuSet);
+    }
+    else if (launchPlacement.cpuMode == PLACEMENT_ROUND_ROBIN)
+        printf("round-robin");
+    else
+        printf("off");
+    printf("\n");
+
+    SetTextColorAndStyle(BLACK_COLOR, BOLD_FONT);
+    printf(" > ");
+    SetTextColorAndStyle(BLUE_COLOR, REGULAR_FONT);
+    const char* numaNames[] = { "off", "", "interleave", "local", "round-robin" };
+    printf("numa:     %s\n\n", numaNames[launchPlacement.numaMode]);
+}
+/**
+ * @brief Runs one command with a temporary launch placement, then
+ *       puts the session placement back. Used when 'affinity' or
+ *       'numa' is given a command after its policy argument.
+ * 
+ * @param args - array of strings. The command name followed by arguments.
+ * @param argCount - numer of entries in the args array.
+ * @param saved - the session placement to restore afterwards.
+ * @return int - the command's exit status.
+ */
+int RunWithPlacement(char** args, size_t argCount, const LaunchPlacement* saved) {
+    CommandHandler(args, argCount);
+
+    // keep round-robin progress made by the command
+    size_t nextCpu = launchPlacement.nextCpu;
+    size_t nextNode = launchPlacement.nextNode;
+    launchPlacement = *saved;
+    launchPlacement.nextCpu = nextCpu;
+    launchPlacement.nextNode = nextNode;
+    return lastCommandStatus;
+}
+/**
+ * @brief The function corresponding to the 'affinity' wash command.
+ *       This function sets which CPUs external commands run on.
+ *       The argument is a CPU list like 0-7, 'rr' to give each new
+ *       command the next CPU, or 'off'. If a command follows the 
+ *       argument, only that command uses the new setting. With no 
+ *       arguments the current placement is printed.
+ * 
+ * @param args - the array of arguments given for this command.
+ * @param argCount - numer of arguments given for this command.
+ * @return int - 0 on success, or the command's exit status.
+ */
+int CommandAffinity(char** args, size_t argCount) {
+    if (argCount == 0) {
+        PrintLaunchPlacement();
+        return 0;
+    }
+
+    LaunchPlacement saved = launchPlacement;
+    if (strcmp(args[0], "off") == 0) {
+        launchPlacement.cpuMode = PLACEMENT_OFF;
+    }
+    else if (strcmp(args[0], "rr") == 0) {
+        launchPlacement.cpuMode = PLACEMENT_ROUND_ROBIN;
+    }
+    else if (ParseCpuList(args[0], &launchPlacement.cpuSet)) {
+        launchPlacement.cpuMode = PLACEMENT_FIXED;
+    }
+    else {
+        launchPlacement = saved;
+        PrintError("'affinity' expects a CPU list like 0-7, 'rr' or 'off'.");
+        return 1;
+    }
+
+    if (argCount > 1)
+        return RunWithPlacement(&args[1], argCount - 1, &saved);
+    return 0;
+}
+/**
+ * @brief The function corresponding to the 'numa' wash command.
+ *       This function sets the NUMA memory policy of external 
+ *       commands: 'interleave' spreads pages over every node, 
+ *       'local' keeps them on the node the command runs on, 'rr'
+ *       binds each new command to the next node, and 'off' turns
+ *       the policy off. If a command follows the argument, only
+ *       that command uses the new setting.
+ * 
+ * @param args - the array of arguments given for this command.
+ * @param argCount - numer of arguments given for this command.
+ * @return int - 0 on success, or the command's exit status.
+ */
+int CommandNuma(char** args, size_t argCount) {
+    if (argCount == 0) {
+        PrintLaunchPlacement();
+        return 0;
+    }
+
+    LaunchPlacement saved = launchPlacement;
+    if (strcmp(args[0], "off") == 0) {
+        launchPlacement.numaMode = PLACEMENT_OFF;
+    }
+    else if (strcmp(args[0], "interleave") == 0) {
+        launchPlacement.numaMode = PLACEMENT_INTERLEAVE;
+    }
+    else if (strcmp(args[0], "local") == 0) {
+        launchPlacement.numaMode = PLACEMENT_LOCAL;
+    }
+    else if (strcmp(args[0], "rr") == 0) {
+        launchPlacement.numaMode = PLACEMENT_ROUND_ROBIN;
+    }
+    else {
+        PrintError("'numa' expects 'interleave', 'local', 'rr' or 'off'.");
+        return 1;
+    }
+
+    if (argCount > 1)
+        return RunWithPlacement(&args[1], argCount - 1, &saved);
+    return 0;
+}
+
+/**
+ * @brief The function corresponding to the 'zygote' wash command.
+ *       'zygote on [count]' keeps count helper processes (2 by 
+ *       default) forked and waiting, so external commands start 
+ *       with one message and an exec instead of a fork. 'zygote off'
+ *       stops the helpers. With no arguments the pool is printed.
+ * 
+ * @param args - the array of arguments given for this command.
+ * @param argCount - numer of arguments given for this command.
+ * @return int - 0 on success, 1 on failure.
+ */
+int CommandZygote(char** args, size_t argCount) {
+    if (argCount == 0) {
+        SetTextColorAndStyle(BLACK_COLOR, BOLD_FONT);
+        printf(" > ");
+        SetTextColorAndStyle(BLUE_COLOR, REGULAR_FONT);
+        ZygoteCollect(false);
+        if (zygotePool.size == 0)
+            printf("zygote: off\n\n");
+        else
+            printf("zygote: %zu of %zu helpers waiting\n\n", zygotePool.count, zygotePool.size);
+        return 0;
+    }
+
+    if (strcmp(args[0], "off") == 0) {
+        if (argCount > 1)
+            PrintExtraArgsWarning("zygote off");
+        ZygoteStopAll();
+    }
+    else if (strcmp(args[0], "on") == 0) {
+        int size = argCount > 1 ? atoi(args[1]) : 2;
+        if (size < 1 || size > MAX_ZYGOTES) {
+            PrintError("'zygote on' accepts a helper count from 1 to 8.");
+            return 1;
+        }
+        ZygoteStopAll();
+        if (!ZygoteStartMaster()) {
+            PrintError("Was not able to create a new process.");
+            return 1;
+        }
+        zygotePool.size = size;
+        ZygoteRefill();
+        ZygoteCollect(true);
+    }
+    else {
+        PrintError("'zygote' expects 'on [count]' or 'off'.");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief The function corresponding to the 'timeout' wash command.
+ *       'timeout <secs> <command> [args]' runs the command, and stops
+ *       it with SIGTERM if it is still running after secs seconds, 
+ *       then with SIGKILL two seconds later. Fractions like 0.5 work.
+ *       Only external commands are stopped; a built-in that runs 
+ *       them, like 'memo', passes the timeout on.
+ * 
+ * @param args - the array of arguments given for this command.
+ * @param argCount - numer of arguments given for this command.
+ * @return int - the command's exit status, or 1 on bad arguments.
+ */
+int CommandTimeout(char** args, size_t argCount) {
+    char* end = NULL;
+    double seconds = argCount > 0 ? strtod(args[0], &end) : 0;
+    if (argCount < 2 || end == args[0] || *end != '\0' || !(seconds > 0) || seconds > 31536000) {
+        PrintError("'timeout' expects a number of seconds and a command.");
+        return 1;
+    }
+
+    unsigned long saved = launchLimits.timeoutMilliseconds;
+    launchLimits.timeoutMilliseconds = seconds * 1000 > 1 ? seconds * 1000 : 1;
+    CommandHandler(&args[1], argCount - 1);
+    launchLimits.timeoutMilliseconds = saved;
+    return lastCommandStatus;
+}
+/**
+ * @brief Prints the session's resource limits, as set by 'limit'.
+ */
+void PrintLaunchLimits() {
+    const char* names[] = { "cpu:  ", "mem:  ", "files:" };
+    const char* units[] = { " seconds", " MB", "" };
+    rlim_t values[] = { launchLimits.cpuSeconds, launchLimits.addressSpaceMB, launchLimits.openFiles };
+    for (int i = 0; i < 3; i++) {
+        SetTextColorAndStyle(BLACK_COLOR, BOLD_FONT);
+        printf(" > ");
+        SetTextColorAndStyle(BLUE_COLOR, REGULAR_FONT);
+        if (values[i] == 0)
+            printf("%s off\n", names[i]);
+        else
+            printf("%s %llu%s\n", names[i], (unsigned long long)values[i], units[i]);
+    }
+    printf("\n");
+}
+/**
+ * @brief The function corresponding to the 'limit' wash command.
+ *       Sets resource limits that every external command started
+ *       after it runs with: 'cpu' seconds of CPU time, 'mem' MB of
+ *       address space, and 'files' open files. Each is given as a
+ *       name and a value or 'off', and several can be set at once,
+ *       like 'limit cpu 10 mem 512'. 'limit off' removes all of them.
+ *       With no arguments the current limits are printed.
+ * 
+ * @param args - the array of arguments given for this command.
+ * @param argCount - numer of arguments given for this command.
+ * @return int - 0 on success, 1 on failure.
+ */
+int CommandLimit(char** args, size_t argCount) {
+    if (argCount == 0) {
+        PrintLaunchLimits();
+        return 0;
+    }
+    if (strcmp(args[0], "off") == 0) {
+        if (argCount > 1)
+            PrintExtraArgsWarning("limit off");
+        launchLimits.cpuSeconds = 0;
+        launchLimits.addressSpaceMB = 0;
+        launchLimits.openFiles = 0;
+        return 0;
+    }
+
+    // check every pair before changing anything
+    LaunchLimits limits = launchLimits;
+    for (size_t i = 0; i < argCount; i += 2) {
+        rlim_t* limit = NULL;
+        if (strcmp(args[i], "cpu") == 0)
+            limit = &limits.cpuSeconds;
+        else if (strcmp(args[i], "mem") == 0)
+            limit = &limits.addressSpaceMB;
+        else if (strcmp(args[i], "files") == 0)
+            limit = &limits.openFiles;
+
+        char* end = NULL;
+        unsigned long long value = i + 1 < argCount ? strtoull(args[i + 1], &end, 10) : 0;
+        bool isOff = i + 1 < argCount && strcmp(args[i + 1], "off") == 0;
+        if (limit == NULL || i + 1 >= argCount || (!isOff && (end == args[i + 1] || *end != '\0' || 
+            value == 0 || args[i + 1][0] == '-' || value > 1ULL << 40))) {
+            PrintError("'limit' expects 'cpu <secs>', 'mem <MB>' or 'files <count>', or 'off'.");
+            return 1;
+        }
+        *limit = isOff ? 0 : value;
+    }
+    launchLimits = limits;
+    return 0;
+}
+
+#define MEMO_MAGIC "WASHMEM"
+#define MEMO_DEFAULT_LIMIT_MB 256
+#define MEMO_LIMIT_FILE "limit"
+
+/**
+ * @brief The start of a memo cache entry. The command's output follows.
+ */
+typedef struct MemoEntryHeader {
+    char magic[8];
+    int32_t exitCode;
+    uint32_t reserved;
+    uint64_t outputSize;
+} MemoEntryHeader;
+
+/**
+ * @brief Size limit of the memo cache in bytes. Set by 'memo --limit',
+ *       which saves it in the cache's "limit" file so every wash 
+ *       process trims the cache to the same size.
+ */
+uint64_t memoCacheLimit = (uint64_t)MEMO_DEFAULT_LIMIT_MB * 1024 * 1024;
+
+/**
+ * @brief A memo cache miss while its command runs: the new entry its
+ *       output goes to, and the key it is published under once the
+ *       command has finished.
+ */
+typedef struct MemoRun {
+    int fd;                                     // the new entry, open for writing
+    char directory[MAX_PATH_LENGTH];
+    char temporaryPath[MAX_PATH_LENGTH + 40];
+    char entryPath[MAX_PATH_LENGTH + 40];
+} MemoRun;
+
+/**
+ * @brief Creates a directory and any missing parents, like mkdir -p.
+ * 
+ * @param path - the directory to create.
+ * @return true/false - does the directory exist now?
+ */
+bool MakeDirectories(const char* path) {
+    char partial[MAX_PATH_LENGTH];
+    snprintf(partial, MAX_PATH_LENGTH, "%s", path);
+    for (char* slash = strchr(partial + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(partial, 0700);
+        *slash = '/';
+    }
+    return mkdir(partial, 0700) == 0 || errno == EEXIST;
+}
+/**
+ * @brief Finds the memo cache directory, $XDG_CACHE_HOME/wash/memo or
+ *       ~/.cache/wash/memo, and creates it if needed. The size limit
+ *       saved by 'memo --limit' is read from it into memoCacheLimit.
+ * 
+ * @param directory - receives the directory path.
+ * @return true/false - is the directory usable?
+ */
+bool GetMemoDirectory(char* directory) {
+    const char* cacheHome = getenv("XDG_CACHE_HOME");
+    if (cacheHome != NULL && cacheHome[0] == '/')
+        snprintf(directory, MAX_PATH_LENGTH, "%s/wash/memo", cacheHome);
+    else if (getenv("HOME") != NULL)
+        snprintf(directory, MAX_PATH_LENGTH, "%s/.cache/wash/memo", getenv("HOME"));
+    else
+        return false;
+    if (!MakeDirectories(directory))
+        return false;
+
+    char limitPath[MAX_PATH_LENGTH + 16];
+    char limitText[32] = "";
+    snprintf(limitPath, sizeof(limitPath), "%s/%s", directory, MEMO_LIMIT_FILE);
+    int fd = open(limitPath, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        ssize_t bytesRead = read(fd, limitText, sizeof(limitText) - 1);
+        limitText[bytesRead > 0 ? bytesRead : 0] = '\0';
+        close(fd);
+    }
+    long long megabytes = atoll(limitText);
+    memoCacheLimit = (uint64_t)(megabytes > 0 ? megabytes : MEMO_DEFAULT_LIMIT_MB) * 1024 * 1024;
+    return true;
+}
+/**
+ * @brief Saves the memo cache size limit in the cache directory, so
+ *       later wash processes use it too.
+ * 
+ * @param directory - the memo cache directory.
+ * @param megabytes - the limit.
+ * @return true/false - was it saved?
+ */
+bool SaveMemoCacheLimit(const char* directory, long long megabytes) {
+    char limitPath[MAX_PATH_LENGTH + 16];
+    char temporaryPath[MAX_PATH_LENGTH + 40];
+    char limitText[32];
+    snprintf(limitPath, sizeof(limitPath), "%s/%s", directory, MEMO_LIMIT_FILE);
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s/tmp.XXXXXX", directory);
+    int length = snprintf(limitText, sizeof(limitText), "%lld\n", megabytes);
+
+    // write to a temporary file first so readers never see half a limit
+    int fd = mkostemp(temporaryPath, O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    bool isWritten = WriteAll(fd, limitText, length);
+    close(fd);
+    if (!isWritten || rename(temporaryPath, limitPath) == -1) {
+        unlink(temporaryPath);
+        return false;
+    }
+    return true;
+}
+/**
+ * @brief Adds bytes to a 128-bit memo key, made of two FNV-1a hashes
+ *       with different seeds.
+ * 
+ * @param key - the key so far.
+ * @param data - the bytes to add.
+ * @param size - number of bytes.
+ */
+void MemoKeyAdd(uint64_t key[2], const void* data, size_t size) {
+    key[0] = HashBytes(data, size, key[0]);
+    key[1] = HashBytes(data, size, key[1]);
+}
+/**
+ * @brief Adds a file's identity (path, size, mtime and inode) to a 
+ *       memo key, so the key changes when the file does.
+ * 
+ * @param key - the key so far.
+ * @param path - the file.
+ * @param fileStat - the file's stats.
+ */
+void MemoKeyAddFile(uint64_t key[2], const char* path, const struct stat* fileStat) {
+    MemoKeyAdd(key, path, strlen(path) + 1);
+    MemoKeyAdd(key, &fileStat->st_size, sizeof(fileStat->st_size));
+    MemoKeyAdd(key, &fileStat->st_mtim, sizeof(fileStat->st_mtim));
+    MemoKeyAdd(key, &fileStat->st_ino, sizeof(fileStat->st_ino));
+    MemoKeyAdd(key, &fileStat->st_dev, sizeof(fileStat->st_dev));
+}
+/**
+ * @brief Writes a memo entry's output to the console. When the console
+ *       is the real stdout the file is copied by the kernel with 
+ *       sendfile(). Captured output, like in $(...) or server mode,
+ *       goes through stdout instead.
+ * 
+ * @param fd - the open cache entry, with the header already read.
+ * @param outputSize - number of output bytes after the header.
+ */
+void ReplayMemoOutput(int fd, uint64_t outputSize) {
+    fflush(stdout);
+    off_t offset = sizeof(MemoEntryHeader);
+    uint64_t remaining = outputSize;
+
+    if (!isCapturingOutput) {
+        while (remaining > 0) {
+            ssize_t sent = sendfile(STDOUT_FILENO, fd, &offset, remaining);
+            if (sent <= 0) {
+                if (sent < 0 && errno == EINTR)
+                    continue;
+                break;
+            }
+            remaining -= sent;
+        }
+    }
+
+    // copy whatever sendfile() couldn't
+    char chunk[65536];
+    while (remaining > 0) {
+        ssize_t bytesRead = pread(fd, chunk, remaining < sizeof(chunk) ? remaining : sizeof(chunk), offset);
+        if (bytesRead <= 0)
+            break;
+        fwrite(chunk, 1, bytesRead, stdout);
+        offset += bytesRead;
+        remaining -= bytesRead;
+    }
+    fflush(stdout);
+}
+/**
+ * @brief A memo cache entry found while trimming the cache.
+ */
+typedef struct MemoEntry {
+    char name[40];
+    struct timespec lastUsed;
+    off_t size;
+} MemoEntry;
+
+/**
+ * @brief qsort() comparison that puts memo entries least recently used
+ *       first.
+ * 
+ * @param a - pointer to the first entry.
+ * @param b - pointer to the second entry.
+ * @return int - less than, equal to or greater than zero.
+ */
+int CompareMemoEntries(const void* a, const void* b) {
+    const MemoEntry* first = a;
+    const MemoEntry* second = b;
+    if (first->lastUsed.tv_sec != second->lastUsed.tv_sec)
+        return first->lastUsed.tv_sec < second->lastUsed.tv_sec ? -1 : 1;
+    if (first->lastUsed.tv_nsec != second->lastUsed.tv_nsec)
+        return first->lastUsed.tv_nsec < second->lastUsed.tv_nsec ? -1 : 1;
+    return 0;
+}
+/**
+ * @brief Removes least recently used memo entries until the cache is 
+ *       under its size limit. An entry's mtime is updated each time
+ *       it is used, so the oldest mtime is the least recently used.
+ * 
+ * @param directory - the memo cache directory.
+ */
+void TrimMemoCache(const char* directory) {
+    DIR* dir = opendir(directory);
+    if (dir == NULL)
+        return;
+
+    MemoEntry* entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    uint64_t totalSize = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat entryStat;
+        if (strlen(entry->d_name) != 32 ||
+            fstatat(dirfd(dir), entry->d_name, &entryStat, 0) == -1) {
+            continue;   // not a cache entry
+        }
+        if (count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            entries = realloc(entries, capacity * sizeof(MemoEntry));
+        }
+        strcpy(entries[count].name, entry->d_name);
+        entries[count].lastUsed = entryStat.st_mtim;
+        entries[count].size = entryStat.st_size;
+        totalSize += entryStat.st_size;
+        count += 1;
+    }
+
+    if (totalSize > memoCacheLimit) {
+        qsort(entries, count, sizeof(MemoEntry), CompareMemoEntries);
+        for (size_t i = 0; i < count && totalSize > memoCacheLimit; i++) {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0)
+                totalSize -= entries[i].size;
+        }
+    }
+    closedir(dir);
+    free(entries);
+}
+/**
+ * @brief Writes the header of a new memo entry once its command has 
+ *       finished, and publishes the entry under its key. A command 
+ *       killed by a signal didn't finish, so its entry is dropped.
+ *       The cache is then trimmed to its limit.
+ * 
+ * @param run - the new entry.
+ * @param status - the command's status from wait4().
+ * @param didRun - did the command start?
+ * @param header - receives the entry's header.
+ */
+void PublishMemoEntry(const MemoRun* run, int status, bool didRun, MemoEntryHeader* header) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, MEMO_MAGIC, sizeof(header->magic));
+    header->exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    off_t end = lseek(run->fd, 0, SEEK_END);
+    header->outputSize = end > (off_t)sizeof(*header) ? end - sizeof(*header) : 0;
+    pwrite(run->fd, header, sizeof(*header), 0);
+
+    if (didRun && WIFEXITED(status))
+        rename(run->temporaryPath, run->entryPath);
+    else
+        unlink(run->temporaryPath);
+    TrimMemoCache(run->directory);
+}
+/**
+ * @brief Runs a command for 'memo' with its output written to a new
+ *       cache entry, and waits for it to finish.
+ * 
+ * @param args - array of strings. The command name followed by arguments.
+ * @param commandPath - the command's executable.
+ * @param policy - the placement and limits to run the command with.
+ * @param fd - the new cache entry, open for writing.
+ * @param status - receives the status from wait4().
+ * @param usage - receives the command's resource usage from wait4().
+ * @param stopSignal - receives the signal a timeout stopped it with, or 0.
+ * @return true/false - did the command run?
+ */
+bool RunMemoCommand(char** args, const char* commandPath, const LaunchPolicy* policy, 
+                    int fd, int* status, struct rusage* usage, int* stopSignal) {
+    lseek(fd, sizeof(MemoEntryHeader), SEEK_SET);
+
+    fflush(stdout);
+    int childFds[3] = { STDIN_FILENO, fd, STDERR_FILENO };
+    int fork_id = ZygoteLaunch(args, commandPath, policy, childFds);
+    if (fork_id == -1)
+        fork_id = fork();
+
+    if (fork_id < 0) {
+        PrintError("Was not able to create a new process.");
+        return false;
+    }
+    else if (fork_id == 0) { // I'm the child
+        dup2(fd, STDOUT_FILENO);
+        signal(SIGPIPE, SIG_DFL);   // a wash server ignores it
+        ApplyLaunchPolicy(policy);
+        execvp(commandPath, args);
+        fprintf(stderr, "(╯°`o°)╯ ┻━┻: Was not able to run '%s'. ", args[0]);
+        fprintf(stderr, "%s\n", strerror( errno ));
+        exit(127);
+    }
+    *stopSignal = WaitForCommand(fork_id, policy->limits.timeoutMilliseconds, status, usage);
+    return true;
+}
+/**
+ * @brief The function corresponding to the 'memo' wash command.
+ *       'memo <cmd> [args]' runs an external command once and keeps
+ *       its output and exit code in a cache. Running it again with
+ *       the same arguments, in the same directory, with the same
+ *       executable and argument files (by path, size, mtime and 
+ *       inode) replays the cached output without running it.
+ *       Only use it for commands that always print the same thing.
+ * 
+ *       Entries are files named by the key's hash. 'memo --limit <MB>'
+ *       sets the cache size; least recently used entries are removed
+ *       first. 'memo --clear' empties the cache.
+ * 
+ *       In a server, a miss runs from the event loop like any other
+ *       external command, and its exit status is sent when it ends.
+ * 
+ * @param args - the array of arguments given for this command.
+ * @param argCount - numer of arguments given for this command.
+ * @return int - the command's exit status, or 1 if it couldn't run.
+ */
+int CommandMemo(char** args, size_t argCount) {
+    char directory[MAX_PATH_LENGTH];
+    if (argCount == 0) {
+        PrintError("'memo' must include a command to run.");
+        return 1;
+    }
+    if (!GetMemoDirectory(directory)) {
+        PrintError("Was not able to create the memo cache directory.");
+        return 1;
+    }
+
+    if (strcmp(args[0], "--limit") == 0) {
+        if (argCount < 2 || atoll(args[1]) <= 0) {
+            PrintError("'memo --limit' expects a size in megabytes.");
+            return 1;
+        }
+        memoCacheLimit = (uint64_t)atoll(args[1]) * 1024 * 1024;
+        if (!SaveMemoCacheLimit(directory, atoll(args[1]))) {
+            PrintError(strerror( errno ));
+            return 1;
+        }
+        TrimMemoCache(directory);
+        return 0;
+    }
+    if (strcmp(args[0], "--clear") == 0) {
+        uint64_t limit = memoCacheLimit;
+        memoCacheLimit = 0;
+        TrimMemoCache(directory);
+        memoCacheLimit = limit;
+        return 0;
+    }
+
+    char commandPath[MAX_PATH_LENGTH];
+    struct stat fileStat;
+    if (GetInputCommandCode(args[0]) != UNKNOWN) {
+        PrintError("'memo' only runs external commands.");
+        return 1;
+    }
+    if (!FindInPathList(shellPaths, args[0], commandPath) || stat(commandPath, &fileStat) == -1) {
+        PrintError("Was not able to run the command. Does it exist?");
+        return 1;
+    }
+
+    // key on the executable, arguments, directory, and argument files
+    uint64_t key[2] = { HASH_SEED, HASH_SEED ^ 0x9e3779b97f4a7c15ULL };
+    MemoKeyAddFile(key, commandPath, &fileStat);
+    for (size_t i = 0; i < argCount; i++) {
+        MemoKeyAdd(key, args[i], strlen(args[i]) + 1);
+    }
+    char cwd[MAX_PATH_LENGTH];
+    getcwd(cwd, MAX_PATH_LENGTH);
+    MemoKeyAdd(key, cwd, strlen(cwd) + 1);
+    for (size_t i = 1; i < argCount; i++) {
+        if (stat(args[i], &fileStat) == 0 && S_ISREG(fileStat.st_mode))
+            MemoKeyAddFile(key, args[i], &fileStat);
+    }
+
+    MemoRun run;
+    snprintf(run.directory, sizeof(run.directory), "%s", directory);
+    snprintf(run.entryPath, sizeof(run.entryPath), "%s/%016llx%016llx", directory,
+             (unsigned long long)key[0], (unsigned long long)key[1]);
+
+    LaunchPolicy policy;
+    int status = 0;
+    struct rusage usage = {0};
+    int stopSignal = 0;
+    MemoEntryHeader header;
+    int fd = open(run.entryPath, O_RDONLY | O_CLOEXEC);
+    bool isHit = fd != -1 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 memcmp(header.magic, MEMO_MAGIC, sizeof(header.magic)) == 0 &&
+                 fstat(fd, &fileStat) == 0 &&
+                 (uint64_t)fileStat.st_size == sizeof(header) + header.outputSize;
+
+    if (isHit) {
+        futimens(fd, NULL);     // mark as recently used
+    }
+    else {
+        if (fd != -1)
+            close(fd);
+
+        // run into a temporary entry, then publish it under its key
+        snprintf(run.temporaryPath, sizeof(run.temporaryPath), "%s/tmp.XXXXXX", directory);
+        run.fd = mkostemp(run.temporaryPath, O_CLOEXEC);
+        if (run.fd == -1) {
+            PrintError(strerror( errno ));
+            return 1;
+        }
+
+        // a server runs it from its event loop, and publishes and
+        // replays the entry when the command finishes
+        if (serverConnection != NULL) {
+            MemoRun* serverRun = malloc(sizeof(MemoRun));
+            *serverRun = run;
+            lseek(run.fd, sizeof(MemoEntryHeader), SEEK_SET);
+            if (ServerStartExternal(serverConnection, args, commandPath, serverRun))
+                return 0;
+            free(serverRun);
+            close(run.fd);
+            unlink(run.temporaryPath);
+            return 1;
+        }
+
+        fd = run.fd;
+        ResolveLaunchPolicy(&policy);
+        PrintCommandBanner("RUNNING", args[0]);
+
+        bool didRun = RunMemoCommand(args, commandPath, &policy, fd, &status, &usage, &stopSignal);
+        PublishMemoEntry(&run, status, didRun, &header);
+    }
+
+    if (isHit)
+        PrintCommandBanner("MEMO", args[0]);
+    ReplayMemoOutput(fd, header.outputSize);
+    close(fd);
+
+    bool isReported = !isHit && ReportCommandStop(args[0], status, &usage, stopSignal, &policy);
+    if (header.exitCode != 0 && !isReported && !isCapturingOutput) {
+        SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+        printf("'%s' exited with status %d.\n", args[0], header.exitCode);
+    }
+    SetTextColorAndStyle(BLUE_COLOR, BOLD_FONT);
+    return header.exitCode;
+}
+
+/**
+ * @brief DispatchCommand calls the function that handles the given
+ *       command. Precompiled scripts call this directly with the
+ *       command code they stored, skipping GetInputCommandCode().
+ *       The command's exit status is kept in lastCommandStatus.
+ * 
+ * @param command - the command to run.
+ * @param userInputTokens - array of strings. The command name followed by arguments.
+ * @param tokenCount - numer of entries in the userInputTokens array.
+ * @return int - return code for the main loop. 
+ *              -1 means stop, otherwise continue
+ */
+int DispatchCommand(Command command, char** userInputTokens, size_t tokenCount) {
+    // if there are arguments, set the args pointer 
+    // to the element after the command token.
+    size_t argCount = tokenCount - 1;
+    char** args = NULL;
+    if (argCount > 0) {
+        args = &userInputTokens[1];
+    }
+
+    if ( command == EXIT ) {
+        return -1;
+    }
+    else if ( command == PWD ) {
+        lastCommandStatus = CommandPwd(argCount);
+    }
+    else if ( command == CD ) {
+        lastCommandStatus = CommandCd(args, argCount);
+    }
+    else if ( command == SETPATH ) {
+        lastCommandStatus = CommandSetPath(args, argCount);
+    }
+    else if ( command == GETPATH ) {
+        lastCommandStatus = CommandGetPath(argCount);
+    }
+    else if ( command == LS ) {
+        lastCommandStatus = CommandLs(args, argCount);
+    }
+    else if ( command == HELP ) {
+        lastCommandStatus = CommandHelp(argCount);
+    }
+    else if ( command == AFFINITY ) {
+        lastCommandStatus = CommandAffinity(args, argCount);
+    }
+    else if ( command == NUMA ) {
+        lastCommandStatus = CommandNuma(args, argCount);
+    }
+    else if ( command == ZYGOTE ) {
+        lastCommandStatus = CommandZygote(args, argCount);
+    }
+    else if ( command == MEMO ) {
+        lastCommandStatus = CommandMemo(args, argCount);
+    }
+    else if ( command == TIMEOUT ) {
+        lastCommandStatus = CommandTimeout(args, argCount);
+    }
+    else if ( command == LIMIT ) {
+        lastCommandStatus = CommandLimit(args, argCount);
+    }
+    else if ( command == UNKNOWN ) {
+        lastCommandStatus = CommandExternal(userInputTokens, tokenCount);
+    }
+
+    return 0;
+}
+/**
+ * @brief CommandHandler accepts parsed user input and calls the 
+ *       appropriate function that handles the specific command.
+ *       The first entry in the passed array of strings is the name
+ *       of the command. If the command is not built-in, the
+ *       command and arguments get sent to CommandExternal().
+ * 
+ *       A integer is returned. If the user signals exit, then
+ *       -1 is returned, otherwise 0 (continue).
+ * 
+ * @param args - array of strings. The command name followed by arguments.
+ * @param argCount - numer of entries in the args array.
+ * @return int - return code for the main loop. 
+ *              -1 means stop, otherwise continue
+ */
+int CommandHandler(char** userInputTokens, size_t tokenCount) {
+    if ( userInputTokens[0] == NULL)
+        return 0;
+    
+    Command command = GetInputCommandCode(userInputTokens[0]);
+    return DispatchCommand(command, userInputTokens, tokenCount);
+}
+
+/**
+ * @brief Splits a line of input into an array of argument strings.
+ *       The tokens point into the given input, which is modified
+ *       by strtok(). Tokens past maxTokens are ignored with a warning.
+ * 
+ * @param input - the line to split. Tokens are delimited by whitespace.
+ * @param tokens - the array that receives the tokens. It is '\0' terminated.
+ * @param maxTokens - size of the tokens array.
+ * @return size_t - the number of tokens found.
+ */
+size_t TokenizeInput(char* input, char** tokens, size_t maxTokens) {
+    // get the first token (the command)
+    char* token = strtok(input, " \t\n");
+
+    // collect all tokens in array of strings, leaving room for the stop symbol
+    size_t count = 0;
+    while ( token != NULL ) {
+        if (count == maxTokens - 1) {
+            SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+            printf("Too many arguments. Only the first %zu were used. ", count);
+            printf("¯\\_(`-`)_/¯ \n\n");
+            break;
+        }
+        tokens[count] = token;
+        count += 1;
+
+        token = strtok(NULL, " \t\n"); // next
+    }
+    tokens[count] = NULL;
+    return count;
+}
+
+#define ARENA_BLOCK_SIZE 8192
+
+/**
+ * @brief One block of memory owned by a LineArena.
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+/**
+ * @brief A bump allocator for memory that only lives as long as one
+ *       line of input, like the arguments made by glob expansion.
+ *       Everything is released at once by ArenaReset() or ArenaFree().
+ */
+typedef struct LineArena {
+    ArenaBlock* blocks;     // newest first
+} LineArena;
+
+/**
+ * @brief Allocates memory from the arena. A new block is added when
+ *       the newest one is full.
+ * 
+ * @param arena - the arena to allocate from.
+ * @param size - number of bytes needed.
+ * @return void* - the memory, aligned for pointers.
+ */
+void* ArenaAllocate(LineArena* arena, size_t size) {
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    ArenaBlock* block = arena->blocks;
+    if (block == NULL || block->used + size > block->size) {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + blockSize);
+        block->next = arena->blocks;
+        block->used = 0;
+        block->size = blockSize;
+        arena->blocks = block;
+    }
+    void* memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+/**
+ * @brief Copies a string into the arena.
+ * 
+ * @param arena - the arena to allocate from.
+ * @param string - the characters to copy.
+ * @param length - number of characters to copy, not counting '\0'.
+ * @return char* - the '\0' terminated copy.
+ */
+char* ArenaCopyString(LineArena* arena, const char* string, size_t length) {
+    char* copy = ArenaAllocate(arena, length + 1);
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+    return copy;
+}
+/**
+ * @brief Releases everything allocated from the arena, but keeps its
+ *       newest block so the next line doesn't need a malloc.
+ * 
+ * @param arena - the arena to reset.
+ */
+void ArenaReset(LineArena* arena) {
+    if (arena->blocks == NULL)
+        return;
+    ArenaBlock* block = arena->blocks->next;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks->next = NULL;
+    arena->blocks->used = 0;
+}
+/**
+ * @brief Frees all of the arena's memory.
+ * 
+ * @param arena - the arena to free.
+ */
+void ArenaFree(LineArena* arena) {
+    ArenaReset(arena);
+    free(arena->blocks);
+    arena->blocks = NULL;
+}
+
+/**
+ * @brief What one step of a compiled glob pattern matches.
+ */
+typedef enum GlobOp {
+    GLOB_LITERAL = 0,       // one specific character
+    GLOB_ANY_CHAR = 1,      // '?'
+    GLOB_ANY_STRING = 2,    // '*'
+    GLOB_CLASS = 3          // '[...]'
+} GlobOp;
+
+typedef struct GlobToken {
+    GlobOp op;
+    unsigned char literal;
+    bool isNegated;             // '[!...]' or '[^...]'
+    uint8_t classBits[32];      // one bit per character in the class
+} GlobToken;
+
+/**
+ * @brief One '/' separated part of a glob pattern, compiled into
+ *       tokens so each directory entry is matched without parsing
+ *       the pattern again.
+ */
+typedef struct GlobSegment {
+    char* text;
+    GlobToken* tokens;
+    size_t tokenCount;
+    bool hasWildcards;
+    bool isRecursive;           // the segment is exactly '**'
+} GlobSegment;
+
+typedef struct GlobPattern {
+    bool isAbsolute;
+    bool isDirectoryOnly;       // the pattern ends in '/'
+    GlobSegment* segments;
+    size_t segmentCount;
+} GlobPattern;
+
+/**
+ * @brief Compiles one segment of a glob pattern. A '[' without a 
+ *       closing ']' is matched as a plain character.
+ * 
+ * @param text - the segment's characters.
+ * @param length - number of characters in the segment.
+ * @param arena - where the tokens are allocated.
+ * @param segment - receives the compiled segment.
+ */
+void CompileGlobSegment(const char* text, size_t length, LineArena* arena, GlobSegment* segment) {
+    memset(segment, 0, sizeof(GlobSegment));
+    segment->text = ArenaCopyString(arena, text, length);
+    segment->tokens = ArenaAllocate(arena, length * sizeof(GlobToken));
+    segment->isRecursive = length == 2 && text[0] == '*' && text[1] == '*';
+
+    size_t i = 0;
+    while (i < length) {
+        GlobToken* token = &segment->tokens[segment->tokenCount];
+        memset(token, 0, sizeof(GlobToken));
+
+        if (text[i] == '*') {
+            segment->hasWildcards = true;
+            i += 1;
+            // '**' inside a segment is the same as '*'
+            if (segment->tokenCount > 0 && token[-1].op == GLOB_ANY_STRING)
+                continue;
+            token->op = GLOB_ANY_STRING;
+        }
+        else if (text[i] == '?') {
+            segment->hasWildcards = true;
+            token->op = GLOB_ANY_CHAR;
+            i += 1;
+        }
+        else if (text[i] == '[') {
+            // find the closing ']', which may be the first class character
+            size_t end = i + 1;
+            if (end < length && (text[end] == '!' || text[end] == '^'))
+                end += 1;
+            if (end < length && text[end] == ']')
+                end += 1;
+            while (end < length && text[end] != ']')
+                end += 1;
+
+            if (end >= length) {
+                token->op = GLOB_LITERAL;
+                token->literal = '[';
+                i += 1;
+            }
+            else {
+                segment->hasWildcards = true;
+                token->op = GLOB_CLASS;
+                size_t current = i + 1;
+                if (text[current] == '!' || text[current] == '^') {
+                    token->isNegated = true;
+                    current += 1;
+                }
+                // the first character can be ']' without closing the class
+                do {
+                    unsigned char first = text[current];
+                    unsigned char last = first;
+                    if (current + 2 < end && text[current + 1] == '-') {
+                        last = text[current + 2];
+                        current += 2;
+                    }
+                    for (unsigned int c = first; c <= last; c++) {
+                        token->classBits[c / 8] |= 1 << (c % 8);
+                    }
+                    current += 1;
+                } while (current < end);
+                i = end + 1;
+            }
+        }
+        else {
+            token->op = GLOB_LITERAL;
+            token->literal = text[i];
             i += 1;
-            strcpy(commandPath, current);
-            strcat(commandPath, "/");
-            strcat(commandPath, args[0]);
-            if (execvp(commandPath, args) != -1) {  // it ran! Done.
-                success = true;
+        }
+        segment->tokenCount += 1;
+    }
+}
+/**
+ * @brief Compiles a glob pattern once so it can be matched against 
+ *       many directory entries. Empty segments, like in 'a//b', are 
+ *       skipped.
+ * 
+ * @param text - the pattern.
+ * @param arena - where the compiled pattern is allocated.
+ * @param pattern - receives the compiled pattern.
+ */
+void CompileGlobPattern(const char* text, LineArena* arena, GlobPattern* pattern) {
+    size_t length = strlen(text);
+    pattern->isAbsolute = text[0] == '/';
+    pattern->isDirectoryOnly = length > 0 && text[length - 1] == '/';
+    pattern->segments = ArenaAllocate(arena, (length / 2 + 1) * sizeof(GlobSegment));
+    pattern->segmentCount = 0;
+
+    const char* current = text;
+    while (*current != '\0') {
+        const char* end = strchr(current, '/');
+        if (end == NULL)
+            end = current + strlen(current);
+        if (end > current) {
+            CompileGlobSegment(current, end - current, arena, 
+                               &pattern->segments[pattern->segmentCount]);
+            pattern->segmentCount += 1;
+        }
+        current = *end == '/' ? end + 1 : end;
+    }
+}
+/**
+ * @brief Tests a directory entry name against a compiled segment.
+ *       Names starting with '.' only match when the segment does.
+ * 
+ * @param segment - the compiled segment.
+ * @param name - the entry name to test.
+ * @return true/false - does the name match?
+ */
+bool MatchGlobSegment(const GlobSegment* segment, const char* name) {
+    const GlobToken* tokens = segment->tokens;
+    size_t count = segment->tokenCount;
+    if (name[0] == '.' && (count == 0 || tokens[0].op != GLOB_LITERAL))
+        return false;
+
+    // on a mismatch, retry from the last '*' with it taking one more character
+    size_t t = 0;
+    const char* n = name;
+    size_t starToken = SIZE_MAX;
+    const char* starName = NULL;
+    while (*n != '\0') {
+        if (t < count && tokens[t].op == GLOB_ANY_STRING) {
+            starToken = t;
+            starName = n;
+            t += 1;
+            continue;
+        }
+
+        bool isMatch = false;
+        if (t < count) {
+            unsigned char c = *n;
+            if (tokens[t].op == GLOB_LITERAL)
+                isMatch = c == tokens[t].literal;
+            else if (tokens[t].op == GLOB_ANY_CHAR)
+                isMatch = true;
+            else
+                isMatch = ((tokens[t].classBits[c / 8] >> (c % 8)) & 1) != tokens[t].isNegated;
+        }
+
+        if (isMatch) {
+            t += 1;
+            n += 1;
+        }
+        else if (starToken != SIZE_MAX) {
+            t = starToken + 1;
+            n = ++starName;
+        }
+        else {
+            return false;
+        }
+    }
+    while (t < count && tokens[t].op == GLOB_ANY_STRING)
+        t += 1;
+    return t == count;
+}
+
+#define MAX_DIRECTORY_SNAPSHOTS 64
+
+typedef struct DirectoryEntry {
+    size_t nameOffset;      // into the snapshot's names
+    unsigned char type;     // d_type from readdir()
+} DirectoryEntry;
+
+/**
+ * @brief The entries of one directory, read once and reused by later
+ *       globs while the directory is unchanged. A snapshot is keyed
+ *       by the directory's device, inode and modification time.
+ */
+typedef struct DirectorySnapshot {
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+    bool isStable;          // modified before the second it was read in
+    bool isCached;
+    size_t pinCount;        // expansions still walking this snapshot
+    unsigned long lastUsed;
+    CaptureBuffer names;
+    DirectoryEntry* entries;
+    size_t entryCount;
+} DirectorySnapshot;
+
+DirectorySnapshot* directorySnapshots[MAX_DIRECTORY_SNAPSHOTS] = {0};
+unsigned long directorySnapshotClock = 0;
+
+/**
+ * @brief Frees a snapshot's memory.
+ * 
+ * @param snapshot - the snapshot to free.
+ */
+void FreeDirectorySnapshot(DirectorySnapshot* snapshot) {
+    free(snapshot->names.data);
+    free(snapshot->entries);
+    free(snapshot);
+}
+/**
+ * @brief Returns the entries of a directory, from the snapshot cache
+ *       when the directory's (device, inode, mtime) still matches. 
+ *       A directory changed in the same second it was read could
+ *       change again without its mtime moving, so those snapshots
+ *       are read again next time.
+ * 
+ *       The snapshot is pinned until ReleaseDirectorySnapshot() is
+ *       called, so walking subdirectories can't evict it.
+ * 
+ * @param path - the directory.
+ * @return DirectorySnapshot* - the entries, or NULL if it can't be read.
+ */
+DirectorySnapshot* GetDirectorySnapshot(const char* path) {
+    struct stat directoryStat;
+    if (stat(path, &directoryStat) == -1 || !S_ISDIR(directoryStat.st_mode))
+        return NULL;
+
+    directorySnapshotClock += 1;
+    size_t evictIndex = SIZE_MAX;
+    for (size_t i = 0; i < MAX_DIRECTORY_SNAPSHOTS; i++) {
+        DirectorySnapshot* cached = directorySnapshots[i];
+        if (cached == NULL) {
+            evictIndex = i;
+            break;
+        }
+        if (cached->device == directoryStat.st_dev && cached->inode == directoryStat.st_ino &&
+            cached->modified.tv_sec == directoryStat.st_mtim.tv_sec &&
+            cached->modified.tv_nsec == directoryStat.st_mtim.tv_nsec && cached->isStable) {
+            cached->lastUsed = directorySnapshotClock;
+            cached->pinCount += 1;
+            return cached;
+        }
+        // least recently used, and not being walked right now
+        if (cached->pinCount == 0 && (evictIndex == SIZE_MAX || 
+            cached->lastUsed < directorySnapshots[evictIndex]->lastUsed)) {
+            evictIndex = i;
+        }
+    }
+
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return NULL;
+
+    DirectorySnapshot* snapshot = calloc(1, sizeof(DirectorySnapshot));
+    snapshot->device = directoryStat.st_dev;
+    snapshot->inode = directoryStat.st_ino;
+    snapshot->modified = directoryStat.st_mtim;
+    snapshot->isStable = directoryStat.st_mtim.tv_sec < time(NULL);
+    snapshot->lastUsed = directorySnapshotClock;
+    snapshot->pinCount = 1;
+
+    size_t capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (snapshot->entryCount == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            snapshot->entries = realloc(snapshot->entries, capacity * sizeof(DirectoryEntry));
+        }
+        snapshot->entries[snapshot->entryCount].nameOffset = snapshot->names.length;
+        snapshot->entries[snapshot->entryCount].type = entry->d_type;
+        snapshot->entryCount += 1;
+        CaptureBufferAppend(&snapshot->names, entry->d_name, strlen(entry->d_name) + 1);
+    }
+    closedir(dir);
+
+    // every cached snapshot is pinned, so this one is only used once
+    if (evictIndex == SIZE_MAX)
+        return snapshot;
+
+    if (directorySnapshots[evictIndex] != NULL)
+        FreeDirectorySnapshot(directorySnapshots[evictIndex]);
+    directorySnapshots[evictIndex] = snapshot;
+    snapshot->isCached = true;
+    return snapshot;
+}
+/**
+ * @brief Unpins a snapshot from GetDirectorySnapshot(). Snapshots that
+ *       didn't fit in the cache are freed.
+ * 
+ * @param snapshot - the snapshot to release.
+ */
+void ReleaseDirectorySnapshot(DirectorySnapshot* snapshot) {
+    snapshot->pinCount -= 1;
+    if (!snapshot->isCached && snapshot->pinCount == 0)
+        FreeDirectorySnapshot(snapshot);
+}
+
+/**
+ * @brief Growable list of argument strings.
+ */
+typedef struct ArgumentList {
+    char** items;
+    size_t count;
+    size_t capacity;
+} ArgumentList;
+
+/**
+ * @brief Adds an argument to the end of an ArgumentList.
+ * 
+ * @param list - the list to add to.
+ * @param argument - the argument. The list does not copy it.
+ */
+void ArgumentListAdd(ArgumentList* list, char* argument) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity > 0 ? list->capacity * 2 : 32;
+        list->items = realloc(list->items, list->capacity * sizeof(char*));
+    }
+    list->items[list->count] = argument;
+    list->count += 1;
+}
+/**
+ * @brief Tests if a directory entry can be walked into. The type from
+ *       readdir() is used when it is known; otherwise the entry is
+ *       stat()ed. Symbolic links are only followed when asked, so
+ *       '**' can't loop forever.
+ * 
+ * @param entry - the entry.
+ * @param path - the path of the entry.
+ * @param followLinks - should a link to a directory count?
+ * @return true/false - is the entry a directory?
+ */
+bool IsDirectoryEntry(const DirectoryEntry* entry, const char* path, bool followLinks) {
+    if (entry->type == DT_DIR)
+        return true;
+    if (entry->type != DT_UNKNOWN && !(entry->type == DT_LNK && followLinks))
+        return false;
+
+    struct stat entryStat;
+    int result = followLinks ? stat(path, &entryStat) : lstat(path, &entryStat);
+    return result == 0 && S_ISDIR(entryStat.st_mode);
+}
+/**
+ * @brief Adds a path matched by a glob to the results. Patterns that 
+ *       end in '/' only match directories, and keep the '/'.
+ * 
+ * @param pattern - the compiled pattern.
+ * @param path - the matched path.
+ * @param matches - receives the match.
+ * @param arena - where the match is allocated.
+ */
+void AddGlobMatch(const GlobPattern* pattern, const CaptureBuffer* path, 
+                  ArgumentList* matches, LineArena* arena) {
+    if (!pattern->isDirectoryOnly) {
+        ArgumentListAdd(matches, ArenaCopyString(arena, path->data, path->length));
+        return;
+    }
+
+    struct stat matchStat;
+    if (stat(path->data, &matchStat) == -1 || !S_ISDIR(matchStat.st_mode))
+        return;
+    char* match = ArenaAllocate(arena, path->length + 2);
+    memcpy(match, path->data, path->length);
+    strcpy(match + path->length, "/");
+    ArgumentListAdd(matches, match);
+}
+/**
+ * @brief Matches the pattern's segments from segmentIndex on against
+ *       the directory named by path, walking into subdirectories for
+ *       the segments that follow. Segments without wildcards are
+ *       appended without reading the directory.
+ * 
+ * @param pattern - the compiled pattern.
+ * @param segmentIndex - the segment to match next.
+ * @param path - the directory matched so far. Restored before returning.
+ * @param matches - receives every matching path.
+ * @param arena - where matching paths are allocated.
+ */
+void ExpandGlobSegments(const GlobPattern* pattern, size_t segmentIndex, CaptureBuffer* path,
+                        ArgumentList* matches, LineArena* arena) {
+    const GlobSegment* segment = &pattern->segments[segmentIndex];
+    bool isLast = segmentIndex + 1 == pattern->segmentCount;
+    size_t pathLength = path->length;
+    bool needsSlash = pathLength > 0 && path->data[pathLength - 1] != '/';
+
+    if (!segment->hasWildcards) {
+        if (needsSlash)
+            CaptureBufferAppend(path, "/", 1);
+        CaptureBufferAppend(path, segment->text, strlen(segment->text));
+
+        struct stat entryStat;
+        if (!isLast)
+            ExpandGlobSegments(pattern, segmentIndex + 1, path, matches, arena);
+        else if (lstat(path->data, &entryStat) == 0)
+            AddGlobMatch(pattern, path, matches, arena);
+
+        path->length = pathLength;
+        path->data[pathLength] = '\0';
+        return;
+    }
+
+    DirectorySnapshot* snapshot = GetDirectorySnapshot(pathLength > 0 ? path->data : ".");
+    if (snapshot == NULL)
+        return;
+
+    // '**' also matches no directories at all
+    if (segment->isRecursive && !isLast)
+        ExpandGlobSegments(pattern, segmentIndex + 1, path, matches, arena);
+
+    for (size_t i = 0; i < snapshot->entryCount; i++) {
+        const DirectoryEntry* entry = &snapshot->entries[i];
+        const char* name = snapshot->names.data + entry->nameOffset;
+        if (segment->isRecursive ? name[0] == '.' : !MatchGlobSegment(segment, name))
+            continue;
+
+        if (needsSlash)
+            CaptureBufferAppend(path, "/", 1);
+        CaptureBufferAppend(path, name, strlen(name));
+
+        if (segment->isRecursive) {
+            // a trailing '**' matches everything below this directory
+            if (isLast)
+                AddGlobMatch(pattern, path, matches, arena);
+            if (IsDirectoryEntry(entry, path->data, false))
+                ExpandGlobSegments(pattern, segmentIndex, path, matches, arena);
+        }
+        else if (isLast) {
+            AddGlobMatch(pattern, path, matches, arena);
+        }
+        else if (IsDirectoryEntry(entry, path->data, true)) {
+            ExpandGlobSegments(pattern, segmentIndex + 1, path, matches, arena);
+        }
+
+        path->length = pathLength;
+        path->data[pathLength] = '\0';
+    }
+    ReleaseDirectorySnapshot(snapshot);
+}
+/**
+ * @brief qsort() comparison for sorting glob matches by name.
+ * 
+ * @param a - pointer to the first argument string.
+ * @param b - pointer to the second argument string.
+ * @return int - less than, equal to or greater than zero, like strcmp().
+ */
+int CompareArguments(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+/**
+ * @brief Expands the glob patterns ('*', '?', '[...]' and '**') in a
+ *       list of tokens. Each pattern is compiled once and replaced
+ *       by its matches in sorted order. A pattern that matches 
+ *       nothing is passed along unchanged.
+ * 
+ *       The returned array and the matched paths are allocated from
+ *       the line's arena and are released when the arena is reset.
+ * 
+ * @param tokens - the tokens of the line.
+ * @param tokenCount - numer of tokens. Updated to the expanded count.
+ * @param arena - the line's arena.
+ * @return char** - the expanded, NULL terminated arguments.
+ */
+char** ExpandGlobs(char** tokens, size_t* tokenCount, LineArena* arena) {
+    ArgumentList arguments = {0};
+    CaptureBuffer path = {0};
+
+    for (size_t i = 0; i < *tokenCount; i++) {
+        if (strpbrk(tokens[i], "*?[") == NULL) {
+            ArgumentListAdd(&arguments, tokens[i]);
+            continue;
+        }
+
+        GlobPattern pattern;
+        CompileGlobPattern(tokens[i], arena, &pattern);
+        size_t firstMatch = arguments.count;
+        if (pattern.segmentCount > 0) {
+            path.length = 0;
+            CaptureBufferAppend(&path, pattern.isAbsolute ? "/" : "", pattern.isAbsolute);
+            ExpandGlobSegments(&pattern, 0, &path, &arguments, arena);
+        }
+
+        if (arguments.count == firstMatch)
+            ArgumentListAdd(&arguments, tokens[i]);
+        else
+            qsort(&arguments.items[firstMatch], arguments.count - firstMatch, 
+                  sizeof(char*), CompareArguments);
+    }
+
+    char** expanded = ArenaAllocate(arena, (arguments.count + 1) * sizeof(char*));
+    if (arguments.count > 0)
+        memcpy(expanded, arguments.items, arguments.count * sizeof(char*));
+    expanded[arguments.count] = NULL;
+    *tokenCount = arguments.count;
+
+    free(arguments.items);
+    free(path.data);
+    return expanded;
+}
+
+void CaptureCommandOutput(char* commandLine, CaptureBuffer* output);
+
+/**
+ * @brief Expands each command substitution, $(cmd), in a line of 
+ *       input. The command inside the parentheses is run and its
+ *       output replaces the substitution, with newlines and tabs
+ *       turned into spaces so the output splits into arguments.
+ *       Substitutions can be nested.
+ * 
+ *       The returned string is allocated with malloc and must be
+ *       freed by the caller. NULL is returned if a substitution
+ *       is missing its closing parenthesis.
+ * 
+ * @param input - the line of input to expand.
+ * @return char* - the expanded line, or NULL on a syntax error.
+ */
+char* ExpandCommandSubstitutions(const char* input) {
+    CaptureBuffer expanded = {0};
+    CaptureBufferAppend(&expanded, "", 0);
+
+    const char* current = input;
+    const char* start;
+    while ( (start = strstr(current, "$(")) != NULL ) {
+        CaptureBufferAppend(&expanded, current, start - current);
+
+        // find the matching ')' so nested substitutions stay inside
+        const char* end = start + 2;
+        int depth = 1;
+        while (*end != '\0') {
+            if (*end == '(')
+                depth += 1;
+            else if (*end == ')' && --depth == 0)
                 break;
-            }
+            end += 1;
+        }
+        if (*end == '\0') {
+            PrintError("Command substitution is missing a closing ')'.");
+            free(expanded.data);
+            return NULL;
+        }
+
+        // run the inner command and capture what it prints
+        size_t innerLength = end - (start + 2);
+        char* inner = malloc(innerLength + 1);
+        memcpy(inner, start + 2, innerLength);
+        inner[innerLength] = '\0';
+
+        CaptureBuffer output = {0};
+        CaptureCommandOutput(inner, &output);
+        free(inner);
+
+        // trailing newlines are dropped, other whitespace becomes a space
+        while (output.length > 0 && strchr(" \t\n", output.data[output.length - 1]))
+            output.length -= 1;
+        for (size_t i = 0; i < output.length; i++) {
+            if (output.data[i] == '\n' || output.data[i] == '\t')
+                output.data[i] = ' ';
+        }
+        CaptureBufferAppend(&expanded, output.data ? output.data : "", output.length);
+        free(output.data);
+
+        current = end + 1;
+    }
+    CaptureBufferAppend(&expanded, current, strlen(current));
+    return expanded.data;
+}
+
+/**
+ * @brief Runs a built-in command inside the wash process with its
+ *       output written to memory instead of the console. No fork
+ *       is needed, so substitutions like 'cd $(pwd)/x' are cheap.
+ * 
+ * @param tokens - array of strings. The command name followed by arguments.
+ * @param tokenCount - numer of entries in the tokens array.
+ * @param output - the buffer that receives the command's output.
+ * @param errors - the buffer that receives its warnings and errors,
+ *                 or NULL to print them to stderr.
+ */
+void CaptureBuiltinOutput(char** tokens, size_t tokenCount, CaptureBuffer* output, CaptureBuffer* errors) {
+    char* memory = NULL;
+    size_t memorySize = 0;
+    FILE* memoryStream = open_memstream(&memory, &memorySize);
+    if (memoryStream == NULL) {
+        PrintError(strerror( errno ));
+        return;
+    }
+    char* errorMemory = NULL;
+    size_t errorSize = 0;
+    FILE* errorStream = errors ? open_memstream(&errorMemory, &errorSize) : NULL;
+
+    // point stdout at the memory stream while the built-in runs
+    fflush(stdout);
+    FILE* console = stdout;
+    FILE* savedErrors = capturedErrors;
+    bool wasCapturing = isCapturingOutput;
+    stdout = memoryStream;
+    capturedErrors = errorStream;
+    isCapturingOutput = true;
+
+    CommandHandler(tokens, tokenCount);
+
+    fclose(memoryStream);
+    stdout = console;
+    capturedErrors = savedErrors;
+    isCapturingOutput = wasCapturing;
+
+    CaptureBufferAppend(output, memory, memorySize);
+    free(memory);
+    if (errorStream != NULL) {
+        fclose(errorStream);
+        CaptureBufferAppend(errors, errorMemory, errorSize);
+        free(errorMemory);
+    }
+}
+
+/**
+ * @brief Runs a command in a child process with its standard output 
+ *       connected to a pipe, and reads everything written to the pipe
+ *       into the output buffer. External commands are executed from
+ *       the paths set by 'setpath', with the same placement and limits
+ *       as any other external command. Built-ins that change the shell,
+ *       like 'cd' and 'setpath', run in the child so the wash process
+ *       is not affected.
+ * 
+ * @param tokens - array of strings. The command name followed by arguments.
+ * @param tokenCount - numer of entries in the tokens array.
+ * @param output - the buffer that receives the command's output.
+ */
+void CaptureChildOutput(char** tokens, size_t tokenCount, CaptureBuffer* output) {
+    int pipeEnds[2];
+    if (pipe(pipeEnds) == -1) {
+        PrintError(strerror( errno ));
+        return;
+    }
+
+    // pick CPUs and nodes here so round-robin state lives in the parent
+    bool isBuiltin = GetInputCommandCode(tokens[0]) != UNKNOWN;
+    LaunchPolicy policy;
+    if (!isBuiltin)
+        ResolveLaunchPolicy(&policy);
+
+    fflush(stdout);
+    int fork_id = fork();
+    if (fork_id < 0) {
+        PrintError("Was not able to create a new process.");
+        close(pipeEnds[0]);
+        close(pipeEnds[1]);
+        return;
+    }
+    else if (fork_id == 0) { // I'm the child
+        close(pipeEnds[0]);
+        dup2(pipeEnds[1], STDOUT_FILENO);
+        close(pipeEnds[1]);
+        signal(SIGPIPE, SIG_DFL);   // a wash server ignores it
+        isCapturingOutput = true;
+        serverConnection = NULL;    // nested commands run in this child
+        ZygoteForget();             // and are forked by it
+
+        if (isBuiltin) {
+            CommandHandler(tokens, tokenCount);
+            fflush(stdout);
+            exit(0);
+        }
+
+        ApplyLaunchPolicy(&policy);
+        ExecFromShellPaths(tokens);
+
+        // errors go to the console, not into the captured output
+        fprintf(stderr, "(╯°`o°)╯ ┻━┻: Was not able to run '%s'. ", tokens[0]);
+        fprintf(stderr, "Does it exist?\n");
+        exit(1);
+    }
+
+    // read until the child closes its end of the pipe
+    close(pipeEnds[1]);
+    char chunk[4096];
+    ssize_t bytesRead;
+    while ( (bytesRead = read(pipeEnds[0], chunk, sizeof(chunk))) != 0 ) {
+        if (bytesRead < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        CaptureBufferAppend(output, chunk, bytesRead);
+    }
+    close(pipeEnds[0]);
+    waitpid(fork_id, NULL, 0);
+}
+
+/**
+ * @brief Runs the command of a command substitution and appends 
+ *       everything it prints to the output buffer. Built-ins that 
+ *       only print, like 'pwd', 'getpath' and 'ls', are run inside
+ *       the wash process. Everything else runs in a child process.
+ * 
+ * @param commandLine - the text between the parentheses of $(...).
+ * @param output - the buffer that receives the command's output.
+ */
+void CaptureCommandOutput(char* commandLine, CaptureBuffer* output) {
+    char* expanded = ExpandCommandSubstitutions(commandLine);
+    if (expanded == NULL)
+        return;
+
+    LineArena arena = {0};
+    char* tokens[MAX_INPUT_ARGS] = {0};
+    size_t count = TokenizeInput(expanded, tokens, MAX_INPUT_ARGS);
+    char** args = ExpandGlobs(tokens, &count, &arena);
+    if (count > 0) {
+        Command command = GetInputCommandCode(args[0]);
+        if (command == PWD || command == GETPATH || command == LS || command == HELP)
+            CaptureBuiltinOutput(args, count, output, NULL);
+        else
+            CaptureChildOutput(args, count, output);
+    }
+    ArenaFree(&arena);
+    free(expanded);
+}
+
+/**
+ * @brief Message types sent from a wash server to its clients. Each
+ *       message is a one byte type, a four byte payload length, and
+ *       the payload.
+ */
+typedef enum FrameType {
+    FRAME_STDOUT = 'O',     // command output
+    FRAME_STDERR = 'E',     // command error output
+    FRAME_EXIT = 'X'        // command finished, payload is its int exit code
+} FrameType;
+
+/**
+ * @brief What a file descriptor registered with the server's epoll
+ *       instance belongs to.
+ */
+typedef enum WatchKind {
+    WATCH_LISTEN = 0,
+    WATCH_CLIENT = 1,
+    WATCH_STDOUT = 2,
+    WATCH_STDERR = 3,
+    WATCH_DEADLINE = 4,     // timerfd for a running command's timeout
+    WATCH_EXIT = 5          // pidfd of a running command
+} WatchKind;
+
+/**
+ * @brief Passed to epoll as the event's data pointer so events can be
+ *       matched back to their connection.
+ */
+typedef struct ServerWatch {
+    WatchKind kind;
+    struct ServerConnection* connection;
+} ServerWatch;
+
+/**
+ * @brief The state of one client of a wash server. Each connection 
+ *       has its own working directory and 'setpath' paths, and runs
+ *       its commands one at a time in the order they were sent.
+ */
+typedef struct ServerConnection {
+    int socket;
+    char cwd[MAX_PATH_LENGTH];
+    char* paths[MAX_SHELL_PATHS];
+    LaunchPlacement placement;  // its 'affinity' and 'numa' settings
+    LaunchLimits limits;        // its 'limit' settings
+    CaptureBuffer input;        // received bytes that haven't been run yet
+    CaptureBuffer output;       // frames the socket hasn't taken yet
+    size_t outputSent;          // bytes of output already written
+    uint32_t socketEvents;      // what the socket is registered for
+    bool isInputClosed;
+    bool isFinished;            // 'exit' was run
+    bool isBroken;              // the client went away
+    bool isClosed;
+    bool isChildOutputPaused;   // child pipes are out of epoll
+    pid_t child;                // running external command, or 0
+    int childStdout;            // pipe from the child, or -1
+    int childStderr;
+    int childExitPidfd;         // readable once the child exits, or -1.
+                                // also signals it at the deadline
+    bool isChildExited;         // reaped, waiting for its pipes to close
+    int childStatus;            // from wait4() once it is reaped
+    struct rusage childUsage;   // its resource usage, from wait4()
+    char childName[64];         // the command's name, for status messages
+    bool isExpanding;           // the child is expanding $(...) for a line
+    CaptureBuffer expansion;    // the expanded line, as the child prints it
+    MemoRun* memo;              // the 'memo' entry it writes to, or NULL
+    LaunchPolicy childPolicy;   // the placement and limits it runs with
+    int deadlineTimer;          // timerfd for the child's timeout, or -1
+    int stopSignal;             // what the timeout stopped it with, or 0
+    ServerWatch socketWatch;
+    ServerWatch stdoutWatch;
+    ServerWatch stderrWatch;
+    ServerWatch deadlineWatch;
+    ServerWatch exitWatch;
+    struct ServerConnection* nextClosed;
+} ServerConnection;
+
+int serverEpoll = -1;
+char serverStartDirectory[MAX_PATH_LENGTH];
+
+// a client with more unsent output than this gets no more until it reads
+#define SERVER_OUTPUT_LIMIT (256 * 1024)
+
+/**
+ * @brief Writes as much of a client's waiting output as its socket 
+ *       takes right now. Client sockets don't block, so one client 
+ *       that stops reading can't hold up the others. A failed write
+ *       means the client went away; its output is dropped.
+ * 
+ * @param connection - the client to write to.
+ */
+void ServerFlushOutput(ServerConnection* connection) {
+    CaptureBuffer* output = &connection->output;
+    while (connection->outputSent < output->length && !connection->isBroken) {
+        ssize_t written = write(connection->socket, output->data + connection->outputSent, 
+                                output->length - connection->outputSent);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (written < 0)
+            connection->isBroken = true;
+        else
+            connection->outputSent += written;
+    }
+
+    // drop what was sent once it is most of the buffer
+    if (connection->isBroken || connection->outputSent == output->length) {
+        output->length = 0;
+        connection->outputSent = 0;
+    }
+    else if (connection->outputSent > output->length / 2) {
+        output->length -= connection->outputSent;
+        memmove(output->data, output->data + connection->outputSent, output->length);
+        connection->outputSent = 0;
+    }
+}
+/**
+ * @brief Registers a client's file descriptors for the events it is
+ *       ready for. The socket is watched for input until the client 
+ *       is done sending, and for room to write while output waits.
+ *       A running command's pipes are taken out of epoll while the
+ *       client has more than SERVER_OUTPUT_LIMIT bytes waiting, so 
+ *       the command blocks on its pipe instead of filling memory.
+ * 
+ * @param connection - the client to update.
+ */
+void ServerUpdateWatches(ServerConnection* connection) {
+    size_t waiting = connection->output.length - connection->outputSent;
+    uint32_t socketEvents = (connection->isInputClosed ? 0 : EPOLLIN) | (waiting > 0 ? EPOLLOUT : 0);
+    if (socketEvents != connection->socketEvents) {
+        struct epoll_event event = { .events = socketEvents, .data.ptr = &connection->socketWatch };
+        epoll_ctl(serverEpoll, EPOLL_CTL_MOD, connection->socket, &event);
+        connection->socketEvents = socketEvents;
+    }
+
+    bool isFull = waiting > SERVER_OUTPUT_LIMIT;
+    if (isFull == connection->isChildOutputPaused)
+        return;
+    connection->isChildOutputPaused = isFull;
+
+    int pipes[2] = { connection->childStdout, connection->childStderr };
+    ServerWatch* watches[2] = { &connection->stdoutWatch, &connection->stderrWatch };
+    for (int i = 0; i < 2; i++) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = watches[i] };
+        if (pipes[i] != -1)
+            epoll_ctl(serverEpoll, isFull ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, pipes[i], &event);
+    }
+}
+/**
+ * @brief Sends one message to a server client. The message is added
+ *       to the client's output and written as the socket takes it.
+ * 
+ * @param connection - the client to send to.
+ * @param type - the type of message.
+ * @param payload - the message contents.
+ * @param length - number of bytes in the payload.
+ */
+void ServerSendFrame(ServerConnection* connection, FrameType type, const void* payload, uint32_t length) {
+    if (connection->isBroken)
+        return;
+
+    char header[5];
+    header[0] = (char)type;
+    memcpy(&header[1], &length, sizeof(length));
+    CaptureBufferAppend(&connection->output, header, sizeof(header));
+    CaptureBufferAppend(&connection->output, payload, length);
+    ServerFlushOutput(connection);
+    ServerUpdateWatches(connection);
+}
+/**
+ * @brief Exchanges the connection's 'setpath' paths with the ones in
+ *       shellPaths. Called before and after running a command so 
+ *       the built-ins see the connection's paths.
+ * 
+ * @param connection - the client whose paths to swap in or out.
+ */
+void ServerSwapPaths(ServerConnection* connection) {
+    for (size_t i = 0; i < MAX_SHELL_PATHS; i++) {
+        char* path = shellPaths[i];
+        shellPaths[i] = connection->paths[i];
+        connection->paths[i] = path;
+    }
+}
+/**
+ * @brief Exchanges the connection's 'affinity', 'numa' and 'limit' 
+ *       settings with the session ones. Called next to 
+ *       ServerSwapPaths(), so one client's settings never apply to
+ *       another client's commands.
+ * 
+ * @param connection - the client whose settings to swap in or out.
+ */
+void ServerSwapLaunchSettings(ServerConnection* connection) {
+    LaunchPlacement placement = launchPlacement;
+    launchPlacement = connection->placement;
+    connection->placement = placement;
+
+    LaunchLimits limits = launchLimits;
+    launchLimits = connection->limits;
+    connection->limits = limits;
+}
+/**
+ * @brief Closes the timeout timer of a client's command.
+ * 
+ * @param connection - the client whose command finished.
+ */
+void ServerStopDeadline(ServerConnection* connection) {
+    if (connection->deadlineTimer != -1)
+        close(connection->deadlineTimer);   // also removes it from epoll
+    connection->deadlineTimer = -1;
+}
+/**
+ * @brief Called when a client's command reaches its deadline. The 
+ *       command is sent SIGTERM through the pidfd it is reaped with,
+ *       and the timer is set again so it gets SIGKILL if it is still
+ *       running two seconds later. The pidfd stays open until the 
+ *       command is finished, so a reaped pid is never signaled.
+ * 
+ * @param connection - the client whose command timed out.
+ */
+void ServerChildDeadline(ServerConnection* connection) {
+    uint64_t expirations;
+    if (connection->deadlineTimer == -1 || read(connection->deadlineTimer, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    connection->stopSignal = connection->stopSignal == 0 ? SIGTERM : SIGKILL;
+    syscall(SYS_pidfd_send_signal, connection->childExitPidfd, connection->stopSignal, NULL, 0);
+    if (connection->stopSignal == SIGKILL) {
+        ServerStopDeadline(connection);
+        return;
+    }
+    struct itimerspec grace = { .it_value = { TERMINATE_GRACE_MILLISECONDS / 1000, 
+                                              (TERMINATE_GRACE_MILLISECONDS % 1000) * 1000000 } };
+    timerfd_settime(connection->deadlineTimer, 0, &grace, NULL);
+}
+/**
+ * @brief Watches a client's new child in the event loop: its output 
+ *       pipes, and a pidfd that becomes readable when it exits.
+ * 
+ * @param connection - the client the child runs for.
+ * @param child - the child process.
+ * @param stdoutPipe - the read end of its output pipe, or -1.
+ * @param stderrPipe - the read end of its error output pipe.
+ */
+void ServerWatchChild(ServerConnection* connection, pid_t child, int stdoutPipe, int stderrPipe) {
+    connection->child = child;
+    connection->childStdout = stdoutPipe;
+    connection->childStderr = stderrPipe;
+    connection->stopSignal = 0;
+    connection->isChildExited = false;
+
+    struct epoll_event event = { .events = EPOLLIN };
+    if (!connection->isChildOutputPaused) {
+        event.data.ptr = &connection->stdoutWatch;
+        if (stdoutPipe != -1)
+            epoll_ctl(serverEpoll, EPOLL_CTL_ADD, stdoutPipe, &event);
+        event.data.ptr = &connection->stderrWatch;
+        epoll_ctl(serverEpoll, EPOLL_CTL_ADD, stderrPipe, &event);
+    }
+
+    // the child is reaped when its pidfd says it exited, not with a
+    // blocking waitpid() that would hold up every other client
+    connection->childExitPidfd = syscall(SYS_pidfd_open, child, 0);
+    if (connection->childExitPidfd != -1) {
+        event.data.ptr = &connection->exitWatch;
+        epoll_ctl(serverEpoll, EPOLL_CTL_ADD, connection->childExitPidfd, &event);
+    }
+}
+/**
+ * @brief Starts an external command for a server client. The child's
+ *       output and error output are pipes that the event loop reads
+ *       and forwards to the client, so other clients are served 
+ *       while the command runs. A timeout is a timerfd watched by
+ *       the same event loop. For 'memo', the output goes to the new
+ *       cache entry instead, which is sent once the command finishes.
+ * 
+ * @param connection - the client running the command.
+ * @param args - array of strings. The command name followed by arguments.
+ * @param knownPath - the command's executable if it was found earlier, or NULL.
+ * @param memo - the 'memo' entry for the output, or NULL. The 
+ *               connection owns it once the command has started.
+ * @return true/false - did the command start?
+ */
+bool ServerStartExternal(ServerConnection* connection, char** args, const char* knownPath, MemoRun* memo) {
+    int outPipe[2] = { -1, -1 };
+    int errPipe[2];
+    if (memo == NULL && pipe2(outPipe, O_CLOEXEC) == -1) {
+        PrintError(strerror( errno ));
+        return false;
+    }
+    if (pipe2(errPipe, O_CLOEXEC) == -1) {
+        PrintError(strerror( errno ));
+        if (memo == NULL) {
+            close(outPipe[0]);
+            close(outPipe[1]);
+        }
+        return false;
+    }
+
+    LaunchPolicy policy;
+    ResolveLaunchPolicy(&policy);
+
+    // use a waiting zygote helper if there is one
+    fflush(stdout);
+    int devNull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int outputFd = memo != NULL ? memo->fd : outPipe[1];
+    int childFds[3] = { devNull, outputFd, errPipe[1] };
+    int fork_id = ZygoteLaunch(args, knownPath, &policy, childFds);
+    if (fork_id == -1)
+        fork_id = fork();
+
+    if (fork_id == 0) { // I'm the child
+        dup2(devNull, STDIN_FILENO);
+        dup2(outputFd, STDOUT_FILENO);
+        dup2(errPipe[1], STDERR_FILENO);
+        signal(SIGPIPE, SIG_DFL);   // the server ignores it
+
+        ApplyLaunchPolicy(&policy);
+        if (knownPath != NULL)
+            execvp(knownPath, args);
+        ExecFromShellPaths(args);
+
+        fprintf(stderr, "(╯°`o°)╯ ┻━┻: Was not able to run '%s'. ", args[0]);
+        fprintf(stderr, "Does it exist?\n");
+        _exit(127);
+    }
+
+    close(devNull);
+    if (memo == NULL)
+        close(outPipe[1]);
+    close(errPipe[1]);
+    if (fork_id < 0) {
+        PrintError("Was not able to create a new process.");
+        if (memo == NULL)
+            close(outPipe[0]);
+        close(errPipe[0]);
+        return false;
+    }
+
+    connection->memo = memo;
+    connection->childPolicy = policy;
+    snprintf(connection->childName, sizeof(connection->childName), "%s", args[0]);
+    ServerWatchChild(connection, fork_id, outPipe[0], errPipe[0]);
+
+    // the deadline is a timerfd in the same event loop
+    unsigned long timeout = policy.limits.timeoutMilliseconds;
+    if (timeout > 0) {
+        connection->deadlineTimer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        struct itimerspec deadline = { .it_value = { timeout / 1000, (timeout % 1000) * 1000000 } };
+        if (connection->childExitPidfd == -1 || connection->deadlineTimer == -1 ||
+            timerfd_settime(connection->deadlineTimer, 0, &deadline, NULL) == -1) {
+            const char* message = "(╯°`o°)╯ ┻━┻: timeout not applied\n";
+            ServerSendFrame(connection, FRAME_STDERR, message, strlen(message));
+            ServerStopDeadline(connection);
+            return true;
+        }
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = &connection->deadlineWatch };
+        epoll_ctl(serverEpoll, EPOLL_CTL_ADD, connection->deadlineTimer, &event);
+    }
+    return true;
+}
+/**
+ * @brief Starts a child that expands the command substitutions of a
+ *       client's line, so the commands inside $(...) don't block the
+ *       event loop. The child prints the expanded line, which is 
+ *       collected like a command's output and run once the child 
+ *       finishes. See ServerFinishChild().
+ * 
+ * @param connection - the client that sent the line.
+ * @param line - the line to expand.
+ * @return true/false - did the child start?
+ */
+bool ServerStartExpansion(ServerConnection* connection, const char* line) {
+    int outPipe[2];
+    int errPipe[2];
+    if (pipe2(outPipe, O_CLOEXEC) == -1) {
+        PrintError(strerror( errno ));
+        return false;
+    }
+    if (pipe2(errPipe, O_CLOEXEC) == -1) {
+        PrintError(strerror( errno ));
+        close(outPipe[0]);
+        close(outPipe[1]);
+        return false;
+    }
+
+    fflush(stdout);
+    int fork_id = fork();
+    if (fork_id == 0) { // I'm the child
+        int devNull = open("/dev/null", O_RDONLY);
+        dup2(devNull, STDIN_FILENO);
+        dup2(outPipe[1], STDOUT_FILENO);
+        dup2(errPipe[1], STDERR_FILENO);
+
+        // don't keep client sockets or the epoll instance open
+        close_range(3, ~0U, 0);
+        signal(SIGPIPE, SIG_DFL);   // the server ignores it
+        isCapturingOutput = true;
+        capturedErrors = NULL;
+        serverConnection = NULL;
+        ZygoteForget();
+
+        char* expanded = ExpandCommandSubstitutions(line);
+        if (expanded == NULL)
+            _exit(1);
+        bool isWritten = WriteAll(STDOUT_FILENO, expanded, strlen(expanded));
+        _exit(isWritten ? 0 : 1);
+    }
+
+    close(outPipe[1]);
+    close(errPipe[1]);
+    if (fork_id < 0) {
+        PrintError("Was not able to create a new process.");
+        close(outPipe[0]);
+        close(errPipe[0]);
+        return false;
+    }
+
+    connection->isExpanding = true;
+    connection->expansion.length = 0;
+    memset(&connection->childPolicy, 0, sizeof(connection->childPolicy));
+    snprintf(connection->childName, sizeof(connection->childName), "$(...)");
+    ServerWatchChild(connection, fork_id, outPipe[0], errPipe[0]);
+    return true;
+}
+/**
+ * @brief Runs one line sent by a server client. The line goes through
+ *       the same substitution, tokenizing and CommandHandler() steps
+ *       as the prompt, inside the connection's directory, paths and 
+ *       launch settings.
+ *       Built-in output and errors are captured and sent right away,
+ *       with the built-in's exit status. External commands keep 
+ *       running after this returns.
+ * 
+ *       A line with $(...) is expanded by a child first, and runs
+ *       again, already expanded, once that child finishes.
+ * 
+ * @param connection - the client that sent the line.
+ * @param line - the command line to run.
+ * @param isExpanded - have its substitutions already been expanded?
+ */
+void ServerRunLine(ServerConnection* connection, const char* line, bool isExpanded) {
+    CaptureBuffer output = {0};
+    CaptureBuffer errors = {0};
+    int exitCode = 0;
+
+    ServerSwapPaths(connection);
+    ServerSwapLaunchSettings(connection);
+    serverConnection = connection;
+
+    if (chdir(connection->cwd) == -1) {
+        CaptureBufferAppend(&errors, strerror( errno ), strlen(strerror( errno )));
+        CaptureBufferAppend(&errors, "\n", 1);
+        exitCode = 1;
+    }
+    else if (!isExpanded && strstr(line, "$(") != NULL) {
+        if (!ServerStartExpansion(connection, line))
+            exitCode = 1;
+    }
+    else {
+        // output spliced in by $(...) isn't expanded again
+        LineArena arena = {0};
+        char* expanded = AllocateHeapString(line);
+        char* tokens[MAX_INPUT_ARGS] = {0};
+        size_t count = TokenizeInput(expanded, tokens, MAX_INPUT_ARGS);
+        char** args = ExpandGlobs(tokens, &count, &arena);
+
+        if (count > 0 && GetInputCommandCode(args[0]) == EXIT) {
+            connection->isFinished = true;
+        }
+        else if (count > 0) {
+            CaptureBuiltinOutput(args, count, &output, &errors);
+            exitCode = lastCommandStatus;
+        }
+        ArenaFree(&arena);
+        free(expanded);
+
+        // remember where 'cd' left this client
+        getcwd(connection->cwd, MAX_PATH_LENGTH);
+    }
+
+    serverConnection = NULL;
+    ServerSwapLaunchSettings(connection);
+    ServerSwapPaths(connection);
+
+    if (output.length > 0)
+        ServerSendFrame(connection, FRAME_STDOUT, output.data, output.length);
+    if (errors.length > 0)
+        ServerSendFrame(connection, FRAME_STDERR, errors.data, errors.length);
+    free(output.data);
+    free(errors.data);
+
+    // an external command sends its exit code when it finishes
+    if (connection->child == 0)
+        ServerSendFrame(connection, FRAME_EXIT, &exitCode, sizeof(exitCode));
+}
+/**
+ * @brief Closes a client connection. The memory is freed by the event
+ *       loop once the current batch of events has been handled, since
+ *       later events in the batch may still point at it.
+ * 
+ * @param connection - the client to close.
+ * @param closedList - the list of connections to free after the batch.
+ */
+void ServerCloseConnection(ServerConnection* connection, ServerConnection** closedList) {
+    if (connection->isClosed)
+        return;
+
+    // a child still running for a client that left is stopped
+    if (connection->child != 0 && !connection->isChildExited) {
+        kill(connection->child, SIGKILL);
+        waitpid(connection->child, NULL, 0);
+    }
+    ServerStopDeadline(connection);
+    if (connection->childExitPidfd != -1)
+        close(connection->childExitPidfd);
+    if (connection->childStdout != -1)
+        close(connection->childStdout);
+    if (connection->childStderr != -1)
+        close(connection->childStderr);
+    if (connection->memo != NULL) {
+        close(connection->memo->fd);
+        unlink(connection->memo->temporaryPath);
+        free(connection->memo);
+    }
+    close(connection->socket);  // also removes it from epoll
+
+    for (size_t i = 0; connection->paths[i] != NULL; i++) {
+        free(connection->paths[i]);
+    }
+    free(connection->input.data);
+    free(connection->output.data);
+    free(connection->expansion.data);
+
+    connection->isClosed = true;
+    connection->nextClosed = *closedList;
+    *closedList = connection;
+}
+/**
+ * @brief Runs the client's waiting lines until one of them starts an
+ *       external command or no complete lines are left. Closes the 
+ *       connection once the client is done sending and everything 
+ *       it sent has finished.
+ * 
+ * @param connection - the client to run commands for.
+ * @param closedList - the list of connections to free after the batch.
+ */
+void ServerAdvance(ServerConnection* connection, ServerConnection** closedList) {
+    if (connection->isBroken) {
+        ServerCloseConnection(connection, closedList);
+        return;
+    }
+
+    // a client that isn't reading its output gets no new commands
+    while (connection->child == 0 && !connection->isFinished && connection->input.length > 0 &&
+           connection->output.length - connection->outputSent <= SERVER_OUTPUT_LIMIT) {
+        char* newline = memchr(connection->input.data, '\n', connection->input.length);
+        if (newline == NULL && !connection->isInputClosed)
+            return;     // wait for the rest of the line
+
+        size_t lineLength = newline ? (size_t)(newline - connection->input.data) : connection->input.length;
+        char* line = malloc(lineLength + 1);
+        memcpy(line, connection->input.data, lineLength);
+        line[lineLength] = '\0';
+
+        size_t consumed = newline ? lineLength + 1 : lineLength;
+        memmove(connection->input.data, connection->input.data + consumed, 
+                connection->input.length - consumed);
+        connection->input.length -= consumed;
+
+        ServerRunLine(connection, line, false);
+        free(line);
+    }
+
+    // after 'exit', anything else the client sent is dropped. the
+    // connection stays open until its output has been written
+    bool isDone = connection->isFinished || (connection->isInputClosed && connection->input.length == 0);
+    if (connection->child == 0 && isDone && connection->output.length == 0)
+        ServerCloseConnection(connection, closedList);
+    else if (!connection->isBroken)
+        ServerUpdateWatches(connection);
+    else
+        ServerCloseConnection(connection, closedList);
+}
+void ServerFinishChild(ServerConnection* connection, ServerConnection** closedList);
+
+/**
+ * @brief Reads output from a client's running command and forwards it
+ *       to the client. When both output pipes reach end of file and
+ *       the child has exited, its exit code is sent.
+ * 
+ * @param watch - the stdout or stderr watch that is ready.
+ * @param closedList - the list of connections to free after the batch.
+ */
+void ServerReadChildOutput(ServerWatch* watch, ServerConnection** closedList) {
+    ServerConnection* connection = watch->connection;
+    int* pipeEnd = watch->kind == WATCH_STDOUT ? &connection->childStdout : &connection->childStderr;
+    if (*pipeEnd == -1)
+        return;
+
+    char chunk[4096];
+    ssize_t bytesRead = read(*pipeEnd, chunk, sizeof(chunk));
+    if (bytesRead > 0 && connection->isExpanding && watch->kind == WATCH_STDOUT) {
+        CaptureBufferAppend(&connection->expansion, chunk, bytesRead);
+        return;
+    }
+    if (bytesRead > 0) {
+        FrameType type = watch->kind == WATCH_STDOUT ? FRAME_STDOUT : FRAME_STDERR;
+        ServerSendFrame(connection, type, chunk, bytesRead);
+        return;
+    }
+    if (bytesRead < 0 && errno == EINTR)
+        return;
+
+    close(*pipeEnd);    // also removes it from epoll
+    *pipeEnd = -1;
+    ServerFinishChild(connection, closedList);
+}
+/**
+ * @brief Reaps a client's command once its pidfd is readable.
+ * 
+ * @param connection - the client whose command exited.
+ * @param closedList - the list of connections to free after the batch.
+ */
+void ServerChildExited(ServerConnection* connection, ServerConnection** closedList) {
+    if (connection->childExitPidfd == -1 || connection->isChildExited ||
+        wait4(connection->child, &connection->childStatus, WNOHANG, &connection->childUsage) != connection->child)
+        return;
+
+    // kept open for the deadline until the command is finished
+    connection->isChildExited = true;
+    epoll_ctl(serverEpoll, EPOLL_CTL_DEL, connection->childExitPidfd, NULL);
+    ServerFinishChild(connection, closedList);
+}
+/**
+ * @brief Finishes a client's command once it has exited and both of
+ *       its output pipes are closed: sends its exit code and moves on
+ *       to the client's next line. Without a pidfd the child is 
+ *       waited for here.
+ * 
+ * @param connection - the client whose command may be finished.
+ * @param closedList - the list of connections to free after the batch.
+ */
+void ServerFinishChild(ServerConnection* connection, ServerConnection** closedList) {
+    if (connection->childStdout != -1 || connection->childStderr != -1)
+        return;
+    if (!connection->isChildExited) {
+        if (connection->childExitPidfd != -1)
+            return;     // the exit event will come
+        wait4(connection->child, &connection->childStatus, 0, &connection->childUsage);
+    }
+
+    int status = connection->childStatus;
+    connection->child = 0;
+    connection->isChildExited = false;
+    ServerStopDeadline(connection);
+    if (connection->childExitPidfd != -1)
+        close(connection->childExitPidfd);
+    connection->childExitPidfd = -1;
+
+    // an expanded line runs now; a failed expansion was already reported
+    if (connection->isExpanding) {
+        connection->isExpanding = false;
+        CaptureBufferAppend(&connection->expansion, "", 1);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            char* expanded = AllocateHeapString(connection->expansion.data);
+            ServerRunLine(connection, expanded, true);
+            free(expanded);
+        }
+        else {
+            int exitCode = 1;
+            ServerSendFrame(connection, FRAME_EXIT, &exitCode, sizeof(exitCode));
         }
+        connection->expansion.length = 0;
+        ServerAdvance(connection, closedList);
+        return;
+    }
 
-        if (!success)
-        {
-            // newline isn't needed
-            PrintError("Was not able to run the command. Does it exist?");
-            fflush(stdout); // make sure this prints before parent prints
-            exit(1);        // child is finished
+    // a 'memo' command's output is in its entry; publish and send it
+    if (connection->memo != NULL) {
+        MemoEntryHeader header;
+        PublishMemoEntry(connection->memo, status, true, &header);
+        char chunk[65536];
+        off_t offset = sizeof(header);
+        ssize_t bytesRead;
+        while ((bytesRead = pread(connection->memo->fd, chunk, sizeof(chunk), offset)) > 0) {
+            ServerSendFrame(connection, FRAME_STDOUT, chunk, bytesRead);
+            offset += bytesRead;
         }
-        exit(0); // child is finished
+        close(connection->memo->fd);
+        free(connection->memo);
+        connection->memo = NULL;
     }
-    else
-    {
-        /* wait waits for the child fork to finish we pass NULL
-        * as an argument and dont catch the return value because 
-        * we don't need to know the status of the child process 
-        * or its ID.
-        */
-        wait(NULL);
-        SetTextColorAndStyle(BLUE_COLOR, BOLD_FONT);
+
+    // tell the client about a timeout or limit that stopped it
+    char message[512];
+    char* name = connection->childName;
+    DescribeCommandStop(name, status, &connection->childUsage, connection->stopSignal, 
+                        &connection->childPolicy, message, sizeof(message) - 1);
+    if (message[0] != '\0') {
+        strcat(message, "\n");
+        ServerSendFrame(connection, FRAME_STDERR, message, strlen(message));
     }
+    int exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    ServerSendFrame(connection, FRAME_EXIT, &exitCode, sizeof(exitCode));
+
+    ServerAdvance(connection, closedList);
 }
+/**
+ * @brief Accepts a new client. The connection starts in the directory
+ *       the server was started in, with the server's 'setpath' paths
+ *       and its own copy of the launch settings.
+ * 
+ * @param listenSocket - the server's listening socket.
+ */
+void ServerAccept(int listenSocket) {
+    int clientSocket = accept4(listenSocket, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (clientSocket == -1)
+        return;
+
+    ServerConnection* connection = calloc(1, sizeof(ServerConnection));
+    connection->socket = clientSocket;
+    connection->childStdout = -1;
+    connection->childStderr = -1;
+    connection->childExitPidfd = -1;
+    connection->deadlineTimer = -1;
+    strcpy(connection->cwd, serverStartDirectory);
+    for (size_t i = 0; i < MAX_SHELL_PATHS - 1 && shellPaths[i] != NULL; i++) {
+        connection->paths[i] = AllocateHeapString(shellPaths[i]);
+    }
+    connection->placement = launchPlacement;
+    connection->limits = launchLimits;
+    connection->socketWatch = (ServerWatch){ WATCH_CLIENT, connection };
+    connection->stdoutWatch = (ServerWatch){ WATCH_STDOUT, connection };
+    connection->stderrWatch = (ServerWatch){ WATCH_STDERR, connection };
+    connection->deadlineWatch = (ServerWatch){ WATCH_DEADLINE, connection };
+    connection->exitWatch = (ServerWatch){ WATCH_EXIT, connection };
 
+    struct epoll_event event = { .events = EPOLLIN };
+    event.data.ptr = &connection->socketWatch;
+    connection->socketEvents = EPOLLIN;
+    epoll_ctl(serverEpoll, EPOLL_CTL_ADD, clientSocket, &event);
+}
 /**
- * @brief CommandHandler accepts parsed user input and calls the 
- *       appropriate function that handles the specific command.
- *       The first entry in the passed array of strings is the name
- *       of the command. If the command is not built-in, the
- *       command and arguments get sent to CommandExternal().
+ * @brief Runs wash as a server (wash --serve <socket>). Local clients
+ *       connect to a Unix domain socket and send lines of commands.
+ *       Each command's output, error output and exit code are sent
+ *       back as they happen. All clients are handled by one epoll
+ *       loop in one process, so the shell only starts once.
  * 
- *       A integer is returned. If the user signals exit, then
- *       -1 is returned, otherwise 0 (continue).
+ * @param socketPath - where to create the Unix domain socket.
+ * @return int - application return code.
+ */
+int RunServer(const char* socketPath) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        PrintError("The socket path is too long.");
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    // replace a socket left by an earlier server, but nothing else
+    struct stat existing;
+    if (lstat(socketPath, &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            PrintError("The socket path already exists and is not a socket.");
+            return 1;
+        }
+        unlink(socketPath);
+    }
+
+    int listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenSocket == -1 ||
+        bind(listenSocket, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+        listen(listenSocket, 64) == -1) {
+        PrintError(strerror( errno ));
+        return 1;
+    }
+
+    // a client that hangs up shouldn't take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+    getcwd(serverStartDirectory, MAX_PATH_LENGTH);
+
+    serverEpoll = epoll_create1(EPOLL_CLOEXEC);
+    ServerWatch listenWatch = { WATCH_LISTEN, NULL };
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &listenWatch };
+    epoll_ctl(serverEpoll, EPOLL_CTL_ADD, listenSocket, &event);
+
+    SetTextColorAndStyle(YELLOW_COLOR, REGULAR_FONT);
+    printf("WAsh server listening on %s\n", socketPath);
+    SetTextColorAndStyle(DEFAULT_COLOR, REGULAR_FONT);
+    fflush(stdout);
+
+    struct epoll_event events[64];
+    while (true) {
+        int eventCount = epoll_wait(serverEpoll, events, 64, -1);
+        if (eventCount < 0 && errno != EINTR)
+            break;
+
+        ServerConnection* closedList = NULL;
+        for (int i = 0; i < eventCount; i++) {
+            ServerWatch* watch = events[i].data.ptr;
+            if (watch->kind == WATCH_LISTEN) {
+                ServerAccept(listenSocket);
+                continue;
+            }
+
+            ServerConnection* connection = watch->connection;
+            if (connection->isClosed)
+                continue;
+
+            if (watch->kind == WATCH_CLIENT) {
+                uint32_t ready = events[i].events;
+                if (ready & EPOLLOUT)
+                    ServerFlushOutput(connection);
+
+                if ((ready & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !connection->isInputClosed) {
+                    char chunk[4096];
+                    ssize_t bytesRead = read(connection->socket, chunk, sizeof(chunk));
+                    if (bytesRead > 0) {
+                        CaptureBufferAppend(&connection->input, chunk, bytesRead);
+                    }
+                    else if (bytesRead == 0 || (errno != EINTR && errno != EAGAIN)) {
+                        // client is done sending; finish what it sent
+                        connection->isInputClosed = true;
+                    }
+                }
+                else if (ready & (EPOLLHUP | EPOLLERR)) {
+                    connection->isBroken = true;   // nothing more can be sent
+                }
+                ServerAdvance(connection, &closedList);
+            }
+            else if (watch->kind == WATCH_DEADLINE) {
+                ServerChildDeadline(connection);
+            }
+            else if (watch->kind == WATCH_EXIT) {
+                ServerChildExited(connection, &closedList);
+            }
+            else {
+                ServerReadChildOutput(watch, &closedList);
+            }
+
+            if (connection->isBroken)
+                ServerCloseConnection(connection, &closedList);
+        }
+
+        while (closedList != NULL) {
+            ServerConnection* next = closedList->nextClosed;
+            free(closedList);
+            closedList = next;
+        }
+    }
+
+    PrintError(strerror( errno ));
+    close(listenSocket);
+    return 1;
+}
+/**
+ * @brief A small client for a wash server (wash --client <socket>).
+ *       Lines read from stdin are sent to the server, and the output 
+ *       it sends back is written to stdout and stderr. Useful for 
+ *       testing server mode.
  * 
- * @param args - array of strings. The command name followed by arguments.
- * @param argCount - numer of entries in the args array.
- * @return int - return code for the main loop. 
- *              -1 means stop, otherwise continue
+ * @param socketPath - the server's Unix domain socket.
+ * @return int - the exit code of the last command the server ran.
  */
-int CommandHandler(char** userInputTokens, size_t tokenCount) {
-    if ( userInputTokens[0] == NULL)
+int RunClient(const char* socketPath) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "(╯°`o°)╯ ┻━┻: The socket path is too long.\n");
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int serverSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (serverSocket == -1 ||
+        connect(serverSocket, (struct sockaddr*)&address, sizeof(address)) == -1) {
+        fprintf(stderr, "(╯°`o°)╯ ┻━┻: %s\n", strerror( errno ));
+        return 1;
+    }
+
+    // send stdin and read replies at the same time, so a large batch
+    // can't fill both directions of the socket and stall
+    struct pollfd watches[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = serverSocket, .events = POLLIN }
+    };
+    CaptureBuffer replies = {0};
+    int exitCode = 0;
+    while (true) {
+        if (poll(watches, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        char chunk[4096];
+        if (watches[0].revents != 0) {
+            ssize_t bytesRead = read(STDIN_FILENO, chunk, sizeof(chunk));
+            if (bytesRead > 0) {
+                WriteAll(serverSocket, chunk, bytesRead);
+            }
+            else {
+                shutdown(serverSocket, SHUT_WR);
+                watches[0].fd = -1;     // poll ignores negative fds
+            }
+        }
+
+        if (watches[1].revents != 0) {
+            ssize_t bytesRead = read(serverSocket, chunk, sizeof(chunk));
+            if (bytesRead <= 0)
+                break;  // server closed the connection
+            CaptureBufferAppend(&replies, chunk, bytesRead);
+
+            // handle every complete message received so far
+            size_t used = 0;
+            uint32_t length;
+            while (replies.length - used >= 5) {
+                memcpy(&length, replies.data + used + 1, sizeof(length));
+                if (replies.length - used - 5 < length)
+                    break;
+                char type = replies.data[used];
+                char* payload = replies.data + used + 5;
+                if (type == FRAME_STDOUT)
+                    WriteAll(STDOUT_FILENO, payload, length);
+                else if (type == FRAME_STDERR)
+                    WriteAll(STDERR_FILENO, payload, length);
+                else if (type == FRAME_EXIT && length == sizeof(exitCode))
+                    memcpy(&exitCode, payload, sizeof(exitCode));
+                used += 5 + length;
+            }
+            memmove(replies.data, replies.data + used, replies.length - used);
+            replies.length -= used;
+        }
+    }
+
+    free(replies.data);
+    close(serverSocket);
+    return exitCode;
+}
+
+/**
+ * @brief Runs one line of input the way the prompt does: command
+ *       substitutions are expanded, the line is split into tokens,
+ *       globs are expanded, and the command is run.
+ * 
+ * @param line - the line to run. It is not modified.
+ * @param arena - the arena for this line. It is reset afterwards.
+ * @return int - return code from CommandHandler(). -1 means exit.
+ */
+int RunInputLine(const char* line, LineArena* arena) {
+    // run any $(...) substitutions before splitting into tokens
+    char* expandedInput = ExpandCommandSubstitutions(line);
+    if (expandedInput == NULL)
         return 0;
-    
-    Command command = GetInputCommandCode(userInputTokens[0]);
 
-    // if there are arguments, set the args pointer 
-    // to the element after the command token.
-    size_t argCount = tokenCount - 1;
-    char** args = NULL;
-    if (argCount > 0) {
-        args = &userInputTokens[1];
+    // collect all tokens in array of strings, then expand globs
+    char* userInputTokens[MAX_INPUT_ARGS] = {0};
+    size_t count = TokenizeInput(expandedInput, userInputTokens, MAX_INPUT_ARGS);
+    char** args = ExpandGlobs(userInputTokens, &count, arena);
+
+    // process command entered
+    int commandResult = CommandHandler(args, count);
+    ArenaReset(arena);
+    free(expandedInput);
+    return commandResult;
+}
+
+#define NO_STRING UINT32_MAX
+/**
+ * @brief Reads a whole file into a buffer.
+ * 
+ * @param path - the file to read.
+ * @param contents - receives the file's bytes.
+ * @return true/false - was the file read?
+ */
+bool ReadWholeFile(const char* path, CaptureBuffer* contents) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    char chunk[65536];
+    ssize_t bytesRead;
+    CaptureBufferAppend(contents, "", 0);
+    while ( (bytesRead = read(fd, chunk, sizeof(chunk))) != 0 ) {
+        if (bytesRead < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return false;
+        }
+        CaptureBufferAppend(contents, chunk, bytesRead);
     }
+    close(fd);
+    return true;
+}
 
-    if ( command == EXIT ) {
-        return -1;
+/**
+ * @brief How a precompiled script line is run.
+ */
+typedef enum ScriptOp {
+    OP_BUILTIN = 0,     // call DispatchCommand() with the stored command code
+    OP_EXTERNAL = 1,    // launch the stored executable
+    OP_DYNAMIC = 2      // has $(...) or globs; run the stored line with RunInputLine()
+} ScriptOp;
+
+/**
+ * @brief One line of a precompiled script. Arguments are offsets into
+ *       the script's string pool, stored in its argument table.
+ */
+typedef struct ScriptInstruction {
+    uint8_t op;
+    uint8_t command;        // Command code for OP_BUILTIN
+    uint16_t reserved;
+    uint32_t argCount;      // tokens, including the command name
+    uint32_t firstArg;      // index into the argument table
+    uint32_t commandPath;   // executable found at compile time, or NO_STRING
+} ScriptInstruction;
+
+/**
+ * @brief The start of a script cache file. The cache is only used 
+ *       when the script's size, modification time and hash, and the
+ *       starting 'setpath' paths, all match, and the directories 
+ *       commands were looked up in haven't changed.
+ */
+typedef struct ScriptCacheHeader {
+    char magic[8];
+    uint64_t scriptSize;
+    int64_t modifiedSeconds;
+    int64_t modifiedNanoseconds;
+    uint64_t scriptHash;
+    uint64_t pathsHash;
+    uint32_t instructionCount;
+    uint32_t argumentCount;
+    uint32_t stringBytes;
+    uint32_t directoryCount;
+} ScriptCacheHeader;
+
+/**
+ * @brief A 'setpath' directory that commands were looked up in at 
+ *       compile time. If one changes, for example because a command
+ *       was added to it, the script is compiled again so it finds 
+ *       the same executables a fresh compile would.
+ */
+typedef struct ScriptDirectoryStamp {
+    uint32_t path;          // offset of the directory in the string pool
+    uint32_t reserved;
+    uint64_t device;        // all zero if the directory doesn't exist
+    uint64_t inode;
+    int64_t modifiedSeconds;
+    int64_t modifiedNanoseconds;
+} ScriptDirectoryStamp;
+
+#define SCRIPT_CACHE_MAGIC "WASHBC3"
+
+/**
+ * @brief A precompiled script. Everything points into memory, which 
+ *       holds the cache file exactly as it is stored on disk.
+ */
+typedef struct CompiledScript {
+    CaptureBuffer memory;
+    ScriptCacheHeader* header;
+    ScriptInstruction* instructions;
+    uint32_t* arguments;
+    ScriptDirectoryStamp* directories;
+    char* strings;
+} CompiledScript;
+
+/**
+ * @brief Adds a string to a script's string pool.
+ * 
+ * @param strings - the string pool.
+ * @param string - the string to add.
+ * @return uint32_t - the string's offset in the pool.
+ */
+uint32_t AddScriptString(CaptureBuffer* strings, const char* string) {
+    uint32_t offset = strings->length;
+    CaptureBufferAppend(strings, string, strlen(string) + 1);
+    return offset;
+}
+/**
+ * @brief Records the identity and modification time of a directory.
+ *       A directory changed in the last second gets a time that never
+ *       matches, since another change in the same tick of the clock
+ *       wouldn't move its time; the next run compiles again.
+ * 
+ * @param path - the directory.
+ * @param stamp - receives the directory's stamp. path is left alone.
+ */
+void StampDirectory(const char* path, ScriptDirectoryStamp* stamp) {
+    struct stat directoryStat;
+    stamp->device = 0;
+    stamp->inode = 0;
+    stamp->modifiedSeconds = 0;
+    stamp->modifiedNanoseconds = 0;
+    if (stat(path, &directoryStat) == -1)
+        return;
+
+    stamp->device = directoryStat.st_dev;
+    stamp->inode = directoryStat.st_ino;
+    stamp->modifiedSeconds = directoryStat.st_mtim.tv_sec;
+    stamp->modifiedNanoseconds = directoryStat.st_mtim.tv_nsec;
+    if (directoryStat.st_mtim.tv_sec >= time(NULL) - 1)
+        stamp->modifiedSeconds = -1;
+}
+/**
+ * @brief Compiles a script into a flat list of instructions. Each line
+ *       is tokenized once. Built-ins are stored as their command code
+ *       and external commands with the executable they resolve to. 
+ *       'setpath' lines are followed so later commands are looked up
+ *       in the right paths; after a 'setpath' that can't be known 
+ *       ahead of time, commands are looked up when they run. Every
+ *       directory a command was looked up in is stamped.
+ * 
+ * @param source - the script's text.
+ * @param key - the header fields that identify this version of the script.
+ * @param compiled - receives the cache file contents.
+ */
+void CompileScript(const char* source, const ScriptCacheHeader* key, CaptureBuffer* compiled) {
+    CaptureBuffer instructions = {0};
+    CaptureBuffer arguments = {0};
+    CaptureBuffer strings = {0};
+    CaptureBuffer directories = {0};
+    ScriptCacheHeader header = *key;
+
+    // the paths commands are resolved against, as string offsets
+    uint32_t paths[MAX_SHELL_PATHS];
+    size_t pathCount = 0;
+    bool arePathsKnown = true;
+    bool arePathsStamped = false;
+    for (size_t i = 0; shellPaths[i] != NULL; i++) {
+        paths[pathCount++] = AddScriptString(&strings, shellPaths[i]);
     }
-    else if ( command == PWD ) {
-        CommandPwd(argCount);
+
+    const char* current = source;
+    while (*current != '\0') {
+        const char* end = strchr(current, '\n');
+        if (end == NULL)
+            end = current + strlen(current);
+        size_t lineLength = end - current;
+        char* line = malloc(lineLength + 1);
+        memcpy(line, current, lineLength);
+        line[lineLength] = '\0';
+        current = *end == '\n' ? end + 1 : end;
+
+        ScriptInstruction instruction = {0};
+        instruction.commandPath = NO_STRING;
+        instruction.firstArg = arguments.length / sizeof(uint32_t);
+
+        // blank lines and comments
+        size_t indent = strspn(line, " \t");
+        if (line[indent] == '\0' || line[indent] == '#') {
+            free(line);
+            continue;
+        }
+
+        if (strstr(line, "$(") != NULL || strpbrk(line, "*?[") != NULL) {
+            uint32_t offset = AddScriptString(&strings, line);
+            CaptureBufferAppend(&arguments, (char*)&offset, sizeof(offset));
+            instruction.op = OP_DYNAMIC;
+            instruction.argCount = 1;
+
+            // its 'setpath' arguments are only known when it runs
+            char* first = strtok(line, " \t");
+            if (first != NULL && GetInputCommandCode(first) == SETPATH)
+                arePathsKnown = false;
+        }
+        else {
+            char* tokens[MAX_INPUT_ARGS] = {0};
+            uint32_t tokenOffsets[MAX_INPUT_ARGS];
+            size_t count = TokenizeInput(line, tokens, MAX_INPUT_ARGS);
+            for (size_t i = 0; i < count; i++) {
+                tokenOffsets[i] = AddScriptString(&strings, tokens[i]);
+            }
+            CaptureBufferAppend(&arguments, (char*)tokenOffsets, count * sizeof(uint32_t));
+            instruction.argCount = count;
+
+            Command command = GetInputCommandCode(tokens[0]);
+            instruction.op = command == UNKNOWN ? OP_EXTERNAL : OP_BUILTIN;
+            instruction.command = command;
+
+            if (command == SETPATH && count > 1) {
+                pathCount = 0;
+                arePathsKnown = true;
+                arePathsStamped = false;
+                for (size_t i = 1; i < count && pathCount < MAX_SHELL_PATHS - 1; i++) {
+                    // relative paths depend on where 'cd' has gone
+                    if (tokens[i][0] != '/')
+                        arePathsKnown = false;
+                    paths[pathCount++] = tokenOffsets[i];
+                }
+            }
+            else if (command == UNKNOWN && arePathsKnown) {
+                char* pathList[MAX_SHELL_PATHS];
+                for (size_t i = 0; i < pathCount; i++) {
+                    pathList[i] = strings.data + paths[i];
+                }
+                pathList[pathCount] = NULL;
+
+                char commandPath[MAX_PATH_LENGTH];
+                if (FindInPathList(pathList, tokens[0], commandPath))
+                    instruction.commandPath = AddScriptString(&strings, commandPath);
+
+                // stamp each path list once, the first time it is used
+                for (size_t i = 0; i < pathCount && !arePathsStamped; i++) {
+                    ScriptDirectoryStamp stamp = { .path = paths[i] };
+                    StampDirectory(pathList[i], &stamp);
+                    CaptureBufferAppend(&directories, (char*)&stamp, sizeof(stamp));
+                    header.directoryCount += 1;
+                }
+                arePathsStamped = true;
+            }
+        }
+
+        CaptureBufferAppend(&instructions, (char*)&instruction, sizeof(instruction));
+        header.instructionCount += 1;
+        free(line);
     }
-    else if ( command == CD ) {
-        CommandCd(args, argCount);
+
+    header.argumentCount = arguments.length / sizeof(uint32_t);
+    header.stringBytes = strings.length;
+    CaptureBufferAppend(compiled, (char*)&header, sizeof(header));
+    CaptureBufferAppend(compiled, instructions.data ? instructions.data : "", instructions.length);
+    // the stamps have 8 byte fields, so they go before the 4 byte arguments
+    CaptureBufferAppend(compiled, directories.data ? directories.data : "", directories.length);
+    CaptureBufferAppend(compiled, arguments.data ? arguments.data : "", arguments.length);
+    CaptureBufferAppend(compiled, strings.data ? strings.data : "", strings.length);
+    free(instructions.data);
+    free(arguments.data);
+    free(directories.data);
+    free(strings.data);
+}
+/**
+ * @brief Points a CompiledScript at the sections of its memory, and
+ *       checks that every offset stays inside the memory, so a 
+ *       damaged cache file is recompiled instead of trusted.
+ * 
+ * @param script - the script, with memory holding a cache file.
+ * @param key - the header fields the cache must match.
+ * @return true/false - is the cache usable?
+ */
+bool LoadCompiledScript(CompiledScript* script, const ScriptCacheHeader* key) {
+    CaptureBuffer* memory = &script->memory;
+    if (memory->length < sizeof(ScriptCacheHeader))
+        return false;
+
+    script->header = (ScriptCacheHeader*)memory->data;
+    ScriptCacheHeader* header = script->header;
+    if (memcmp(header->magic, key->magic, sizeof(header->magic)) != 0 ||
+        header->scriptSize != key->scriptSize || header->scriptHash != key->scriptHash ||
+        header->modifiedSeconds != key->modifiedSeconds ||
+        header->modifiedNanoseconds != key->modifiedNanoseconds ||
+        header->pathsHash != key->pathsHash) {
+        return false;
     }
-    else if ( command == SETPATH ) {
-        CommandSetPath(args, argCount);
+
+    size_t instructionBytes = (size_t)header->instructionCount * sizeof(ScriptInstruction);
+    size_t argumentBytes = (size_t)header->argumentCount * sizeof(uint32_t);
+    size_t directoryBytes = (size_t)header->directoryCount * sizeof(ScriptDirectoryStamp);
+    if (memory->length != sizeof(ScriptCacheHeader) + instructionBytes + argumentBytes + 
+                          directoryBytes + header->stringBytes ||
+        header->stringBytes == 0 || memory->data[memory->length - 1] != '\0') {
+        return false;
     }
-    else if ( command == GETPATH ) {
-        CommandGetPath(argCount);
+    script->instructions = (ScriptInstruction*)(memory->data + sizeof(ScriptCacheHeader));
+    script->directories = (ScriptDirectoryStamp*)((char*)script->instructions + instructionBytes);
+    script->arguments = (uint32_t*)((char*)script->directories + directoryBytes);
+    script->strings = (char*)script->arguments + argumentBytes;
+
+    for (uint32_t i = 0; i < header->instructionCount; i++) {
+        ScriptInstruction* instruction = &script->instructions[i];
+        if (instruction->argCount == 0 || instruction->op > OP_DYNAMIC || instruction->command > LIMIT ||
+            (uint64_t)instruction->firstArg + instruction->argCount > header->argumentCount ||
+            (instruction->commandPath != NO_STRING && instruction->commandPath >= header->stringBytes)) {
+            return false;
+        }
     }
-    else if ( command == LS ) {
-        CommandLs(argCount);
+    for (uint32_t i = 0; i < header->argumentCount; i++) {
+        if (script->arguments[i] >= header->stringBytes)
+            return false;
     }
-    else if ( command == HELP ) {
-        CommandHelp(argCount);
+
+    for (uint32_t i = 0; i < header->directoryCount; i++) {
+        if (script->directories[i].path >= header->stringBytes)
+            return false;
     }
-    else if ( command == UNKNOWN ) {
-        CommandExternal(userInputTokens, tokenCount);
+    return true;
+}
+/**
+ * @brief Checks that the directories a loaded script looked its 
+ *       commands up in are unchanged. If one changed, it might now
+ *       hold a command that was found somewhere else.
+ * 
+ * @param script - the loaded script.
+ * @return true - every directory still has its stamp.
+ * @return false - the script must be compiled again.
+ */
+bool AreScriptDirectoriesUnchanged(const CompiledScript* script) {
+    for (uint32_t i = 0; i < script->header->directoryCount; i++) {
+        const ScriptDirectoryStamp* stamp = &script->directories[i];
+        if (stamp->modifiedSeconds == -1)
+            return false;
+
+        ScriptDirectoryStamp current = *stamp;
+        StampDirectory(script->strings + stamp->path, &current);
+        if (memcmp(&current, stamp, sizeof(current)) != 0)
+            return false;
+    }
+    return true;
+}
+/**
+ * @brief Runs a precompiled script. Nothing is parsed here: built-ins
+ *       go straight to DispatchCommand() and external commands start
+ *       with the executable found at compile time.
+ * 
+ * @param script - the loaded script.
+ * @return int - return code for the main loop. -1 means the script ran 'exit'.
+ */
+int RunCompiledScript(const CompiledScript* script) {
+    LineArena arena = {0};
+    int commandResult = 0;
+    for (uint32_t i = 0; i < script->header->instructionCount && commandResult != -1; i++) {
+        const ScriptInstruction* instruction = &script->instructions[i];
+        char** args = ArenaAllocate(&arena, (instruction->argCount + 1) * sizeof(char*));
+        for (uint32_t arg = 0; arg < instruction->argCount; arg++) {
+            args[arg] = script->strings + script->arguments[instruction->firstArg + arg];
+        }
+        args[instruction->argCount] = NULL;
+
+        if (instruction->op == OP_DYNAMIC) {
+            commandResult = RunInputLine(args[0], &arena);
+        }
+        else if (instruction->op == OP_EXTERNAL) {
+            const char* commandPath = instruction->commandPath == NO_STRING ? NULL :
+                                      script->strings + instruction->commandPath;
+            lastCommandStatus = LaunchExternal(args, commandPath);
+        }
+        else {
+            commandResult = DispatchCommand(instruction->command, args, instruction->argCount);
+        }
+        ArenaReset(&arena);
+    }
+    ArenaFree(&arena);
+    return commandResult;
+}
+/**
+ * @brief Runs a wash script (wash <script>). The script is compiled
+ *       the first time, and the result is saved next to it in 
+ *       <script>c. Later runs load that file and skip parsing, as 
+ *       long as neither the script nor the directories its commands
+ *       were looked up in have changed.
+ * 
+ * @param scriptPath - the script to run.
+ * @return int - application return code: the status of the last command
+ *               the script ran.
+ */
+int RunScript(const char* scriptPath) {
+    struct stat scriptStat;
+    CaptureBuffer source = {0};
+    if (stat(scriptPath, &scriptStat) == -1 || !ReadWholeFile(scriptPath, &source)) {
+        PrintError(strerror( errno ));
+        free(source.data);
+        return 1;
     }
 
-    return 0;
+    ScriptCacheHeader key = {0};
+    memcpy(key.magic, SCRIPT_CACHE_MAGIC, sizeof(key.magic));
+    key.scriptSize = scriptStat.st_size;
+    key.modifiedSeconds = scriptStat.st_mtim.tv_sec;
+    key.modifiedNanoseconds = scriptStat.st_mtim.tv_nsec;
+    key.scriptHash = HashBytes(source.data, source.length, HASH_SEED);
+    key.pathsHash = HASH_SEED;
+    for (size_t i = 0; shellPaths[i] != NULL; i++) {
+        key.pathsHash = HashBytes(shellPaths[i], strlen(shellPaths[i]) + 1, key.pathsHash);
+    }
+
+    char cachePath[MAX_PATH_LENGTH];
+    snprintf(cachePath, MAX_PATH_LENGTH, "%sc", scriptPath);
+
+    CompiledScript script = {0};
+    bool isCached = ReadWholeFile(cachePath, &script.memory) && LoadCompiledScript(&script, &key) &&
+                    AreScriptDirectoriesUnchanged(&script);
+    if (!isCached) {
+        script.memory.length = 0;
+        CompileScript(source.data, &key, &script.memory);
+        if (!LoadCompiledScript(&script, &key)) {
+            PrintError("Was not able to compile the script.");
+            free(source.data);
+            free(script.memory.data);
+            return 1;
+        }
+
+        // write to a temporary file first so readers never see half a cache
+        char temporaryPath[MAX_PATH_LENGTH + 16];
+        snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d", cachePath, getpid());
+        int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            bool isWritten = WriteAll(fd, script.memory.data, script.memory.length);
+            close(fd);
+            if (!isWritten || rename(temporaryPath, cachePath) == -1)
+                unlink(temporaryPath);
+        }
+    }
+    free(source.data);
+
+    RunCompiledScript(&script);
+    free(script.memory.data);
+    return lastCommandStatus;
 }
 
 /**
@@ -563,11 +5179,38 @@ int CommandHandler(char** userInputTokens, size_t tokenCount) {
  *       parsing that input into an array of strings that
  *       are sent to the CommandHandler.
  * 
+ *       'wash --serve <socket>' runs wash as a server instead, 
+ *       'wash --client <socket>' sends stdin to a running server,
+ *       and 'wash <script>' runs a script file.
+ * 
  * @param argc - command line args count.
  * @param argv - command line arguments.
  * @return int - application return code.
  */
 int main(int argc, char const *argv[]) {
+
+    if (argc == 3 && strcmp(argv[1], "--client") == 0) {
+        return RunClient(argv[2]);
+    }
+
+    // initialize path
+    char cwd[MAX_PATH_LENGTH];
+    getcwd(cwd, MAX_PATH_LENGTH);
+    shellPaths[0] = AllocateHeapString(cwd);
+    shellPaths[1] = '\0'; // end of paths
+
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0) {
+        int serverResult = RunServer(argv[2]);
+        FreeShellPathMemory();
+        return serverResult;
+    }
+
+    if (argc == 2 && strncmp(argv[1], "--", 2) != 0) {
+        int scriptResult = RunScript(argv[1]);
+        ZygoteStopAll();
+        FreeShellPathMemory();
+        return scriptResult;
+    }
    
     SetTextColorAndStyle(PURPLE_COLOR, BOLD_FONT);
     printf("\n ----<-- WASH SHELL -------{--(@\n\n");
@@ -576,14 +5219,9 @@ int main(int argc, char const *argv[]) {
     printf("Welcome to WAsh - the Washington Shell.\n");
     printf("Enter 'help' to see a list of available commands.\n");
 
-    // initialize path
-    char cwd[MAX_PATH_LENGTH];
-    getcwd(cwd, MAX_PATH_LENGTH);
-    shellPaths[0] = AllocateHeapString(cwd);
-    shellPaths[1] = '\0'; // end of paths
-
     // Prompt for input & pass tokens to CommandHandler()
     // until CommandHandler() returns -1 (exit)
+    LineArena lineArena = {0};
     int commandResult = 0;
     do {
         SetTextColorAndStyle(BLUE_COLOR, BOLD_FONT);
@@ -606,25 +5244,13 @@ int main(int argc, char const *argv[]) {
         // remove the newline at the end
         userInput[strlen(userInput)-1] = '\0';
 
-
-        // get the first token (the command)
-        char* token = strtok(userInput, " ");
-
-        // collect all tokens in array of strings
-        size_t count = 0;
-        char* userInputTokens[MAX_INPUT_ARGS] = {0};
-        while ( token != NULL ) {
-            userInputTokens[count] = token;
-            count += 1;
-
-            token = strtok(NULL, " "); // next
-        }
-
         // process command entered
-        commandResult = CommandHandler(userInputTokens, count);
+        commandResult = RunInputLine(userInput, &lineArena);
     } while ( commandResult != -1 );
 
-    // free path strings in shellPaths
+    // stop any zygote helpers and free path strings in shellPaths
+    ArenaFree(&lineArena);
+    ZygoteStopAll();
     FreeShellPathMemory();
 
     SetTextColorAndStyle(PURPLE_COLOR, BOLD_FONT);